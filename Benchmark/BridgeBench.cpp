@@ -0,0 +1,507 @@
+// End-to-end benchmark for the bridge.
+//
+// Runs BridgeApp in-process on the virtual MIDI backend and talks to it
+// through a local client on each transport (TCP and shared memory):
+//
+//   in  : VirtualMidiBackend::Inject -> bridge -> client
+//   out : client -> bridge -> VirtualMidiBackend capture
+//
+// Every message carries a sequence number in its channel and data bytes, so
+// the latency is measured per message. The results are printed as JSON on
+// the standard output; the progress goes to the standard error.
+
+#include "stdafx.h"
+#include "Platform.h"
+#include "BridgeApp.h"
+#include "VirtualMidiBackend.h"
+#include "SharedMemoryChannel.h"
+
+namespace
+{
+	typedef IpcServer::socket_t socket_t;
+
+	// Number of distinct sequence numbers (4 channel bits + 14 data bits).
+	const uint32_t sequenceSpace = 1 << 18;
+
+	int64_t GetNanoseconds()
+	{
+		auto now = std::chrono::steady_clock::now().time_since_epoch();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+	}
+
+	int64_t ToNanoseconds(std::chrono::steady_clock::time_point time)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+	}
+
+	// Sequence number <-> poly pressure message. It's not kept in the state
+	// cache, so the runs don't leave a snapshot for the next client.
+	uint32_t EncodeSequence(uint32_t sequence)
+	{
+		sequence &= sequenceSpace - 1;
+		return (0xa0 | (sequence >> 14)) | ((sequence & 0x7f) << 8) | (((sequence >> 7) & 0x7f) << 16);
+	}
+
+	uint32_t DecodeSequence(const uint8_t* bytes)
+	{
+		return ((bytes[0] & 0x0f) << 14) | (bytes[2] << 7) | bytes[1];
+	}
+
+	// Message pacing.
+	struct Shape
+	{
+		const char* name;
+		double rate;       // Messages per second (0 = as fast as possible).
+		int burstSize;     // Messages sent back to back in each burst.
+	};
+
+	// Latency statistics of a run.
+	struct Result
+	{
+		std::string direction;
+		std::string transport;
+		Shape shape;
+		uint64_t sent;
+		uint64_t received;
+		double seconds;
+		std::vector<double> latencies; // Microseconds.
+	};
+
+	double GetPercentile(const std::vector<double>& sorted, double percentile)
+	{
+		if (sorted.empty()) return 0;
+		size_t index = static_cast<size_t>(percentile / 100 * (sorted.size() - 1) + 0.5);
+		return sorted[std::min(index, sorted.size() - 1)];
+	}
+
+	// Send messages following a shape until the duration expires.
+	// Returns the number of messages sent.
+	template <typename SendFunction>
+	uint64_t RunPacer(const Shape& shape, double duration, SendFunction send)
+	{
+		auto start = GetNanoseconds();
+		auto end = start + static_cast<int64_t>(duration * 1e9);
+		uint64_t sent = 0;
+
+		while (true)
+		{
+			auto now = GetNanoseconds();
+			if (now >= end) break;
+
+			if (shape.rate <= 0)
+			{
+				send(static_cast<uint32_t>(sent++));
+				continue;
+			}
+
+			// Messages due by now, rounded down to whole bursts.
+			auto due = static_cast<uint64_t>((now - start) * 1e-9 * shape.rate);
+			due -= due % shape.burstSize;
+			if (due <= sent)
+			{
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+				continue;
+			}
+
+			while (sent < due) send(static_cast<uint32_t>(sent++));
+		}
+
+		return sent;
+	}
+
+	// Benchmark client connected to the bridge.
+	class Client
+	{
+	public:
+
+		virtual ~Client()
+		{
+		}
+
+		// Returns false if the bridge doesn't respond.
+		virtual bool Connect() = 0;
+
+		// Send all the data (blocking).
+		virtual void Send(const uint8_t* data, size_t length) = 0;
+
+		// Receive available data, waiting up to the timeout. Returns the size.
+		virtual size_t Receive(uint8_t* data, size_t length, int timeoutMilliseconds) = 0;
+
+		virtual const char* GetName() = 0;
+	};
+
+	// Client on the TCP stream.
+	class TcpClient : public Client
+	{
+	public:
+
+		TcpClient()
+			: socket(IpcServer::SOCKET_ERROR)
+		{
+		}
+
+		~TcpClient()
+		{
+			Close();
+		}
+
+		bool Connect() override
+		{
+			socket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+			if (socket == IpcServer::SOCKET_ERROR) return false;
+
+			sockaddr_in addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			addr.sin_port = htons(IpcServer::portNumber);
+			if (connect(socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return false;
+
+			int flag = 1;
+			setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char*>(&flag), sizeof(flag));
+
+			// The version reply tells that the bridge has registered the client.
+			uint8_t request[4] = { IpcProtocol::controlPrefix, IpcProtocol::commandVersion, 1, 0 };
+			Send(request, sizeof(request));
+			return WaitForControl(IpcProtocol::commandVersion, nullptr);
+		}
+
+		void Send(const uint8_t* data, size_t length) override
+		{
+			while (length > 0)
+			{
+				int result = send(socket, reinterpret_cast<const char*>(data), static_cast<int>(length), 0);
+				if (result <= 0) return;
+				data += result;
+				length -= result;
+			}
+		}
+
+		size_t Receive(uint8_t* data, size_t length, int timeoutMilliseconds) override
+		{
+			pollfd entry;
+			entry.fd = socket;
+			entry.events = POLLIN;
+			entry.revents = 0;
+#ifdef WIN32
+			if (WSAPoll(&entry, 1, timeoutMilliseconds) <= 0) return 0;
+#else
+			if (poll(&entry, 1, timeoutMilliseconds) <= 0) return 0;
+#endif
+			int result = recv(socket, reinterpret_cast<char*>(data), static_cast<int>(length), 0);
+			return result > 0 ? result : 0;
+		}
+
+		const char* GetName() override
+		{
+			return "tcp";
+		}
+
+		// Wait for a control record from the bridge, skipping anything else.
+		bool WaitForControl(uint8_t command, uint8_t* record)
+		{
+			uint8_t buffer[4];
+			size_t filled = 0;
+			auto deadline = GetNanoseconds() + 2000000000LL;
+			while (GetNanoseconds() < deadline)
+			{
+				filled += Receive(buffer + filled, 4 - filled, 100);
+				if (filled < 4) continue;
+				filled = 0;
+				if (buffer[0] == IpcProtocol::controlPrefix && buffer[1] == command)
+				{
+					if (record != nullptr) memcpy(record, buffer, 4);
+					return true;
+				}
+			}
+			return false;
+		}
+
+	private:
+
+		socket_t socket;
+
+		void Close()
+		{
+			if (socket == IpcServer::SOCKET_ERROR) return;
+#ifdef WIN32
+			closesocket(socket);
+#else
+			close(socket);
+#endif
+			socket = IpcServer::SOCKET_ERROR;
+		}
+	};
+
+	// Client on the shared memory transport. The TCP connection is kept open.
+	class SharedMemoryClient : public Client
+	{
+	public:
+
+		bool Connect() override
+		{
+			if (!tcp.Connect()) return false;
+
+			uint8_t request[4] = { IpcProtocol::controlPrefix, IpcProtocol::commandSharedMemory, 0, 0 };
+			tcp.Send(request, sizeof(request));
+
+			uint8_t reply[4];
+			if (!tcp.WaitForControl(IpcProtocol::commandSharedMemory, reply)) return false;
+
+			uint16_t id = reply[2] | (reply[3] << 8);
+			if (id == IpcProtocol::invalidChannelId) return false;
+
+			return channel.Open(SharedMemoryChannel::GetName(IpcServer::portNumber, id));
+		}
+
+		void Send(const uint8_t* data, size_t length) override
+		{
+			while (!channel.Write(data, length)) std::this_thread::yield();
+		}
+
+		size_t Receive(uint8_t* data, size_t length, int timeoutMilliseconds) override
+		{
+			size_t result = channel.Read(data, length);
+			if (result > 0) return result;
+			channel.WaitForData(timeoutMilliseconds);
+			return channel.Read(data, length);
+		}
+
+		const char* GetName() override
+		{
+			return "shm";
+		}
+
+	private:
+
+		TcpClient tcp;
+		SharedMemoryChannel channel;
+	};
+
+	std::unique_ptr<Client> CreateClient(const std::string& transport)
+	{
+		if (transport == "shm") return std::unique_ptr<Client>(new SharedMemoryClient());
+		return std::unique_ptr<Client>(new TcpClient());
+	}
+
+	// MIDI in -> client.
+	Result RunInbound(VirtualMidiBackend& backend, Client& client, const Shape& shape, double duration)
+	{
+		std::unique_ptr<std::atomic<int64_t>[]> sendTimes(new std::atomic<int64_t>[sequenceSpace]);
+
+		Result result;
+		result.direction = "in";
+		result.transport = client.GetName();
+		result.shape = shape;
+		result.received = 0;
+
+		std::atomic<bool> sending(true);
+		int64_t lastReceive = 0;
+
+		// Receiver: the bridge speaks version 1 here (4-byte records).
+		std::thread receiver([&]()
+		{
+			uint8_t buffer[64 * 1024];
+			size_t filled = 0;
+			auto idleLimit = 0LL;
+			while (true)
+			{
+				size_t length = client.Receive(buffer + filled, sizeof(buffer) - filled, 10);
+				auto now = GetNanoseconds();
+
+				if (length == 0)
+				{
+					// Stop after the traffic has settled.
+					if (!sending && idleLimit == 0) idleLimit = now + 200000000LL;
+					if (idleLimit != 0 && now >= idleLimit) break;
+					continue;
+				}
+
+				filled += length;
+				size_t offset = 0;
+				for (; offset + 4 <= filled; offset += 4)
+				{
+					if (buffer[offset] == IpcProtocol::controlPrefix) continue;
+					uint32_t sequence = DecodeSequence(buffer + offset);
+					result.latencies.push_back((now - sendTimes[sequence].load(std::memory_order_relaxed)) * 1e-3);
+					result.received++;
+					lastReceive = now;
+				}
+				memmove(buffer, buffer + offset, filled - offset);
+				filled -= offset;
+				if (!sending) idleLimit = 0;
+			}
+		});
+
+		auto start = GetNanoseconds();
+		result.sent = RunPacer(shape, duration, [&](uint32_t sequence)
+		{
+			sendTimes[sequence & (sequenceSpace - 1)].store(GetNanoseconds(), std::memory_order_relaxed);
+			backend.Inject(0, EncodeSequence(sequence));
+		});
+		sending = false;
+		receiver.join();
+
+		result.seconds = ((lastReceive > 0 ? lastReceive : GetNanoseconds()) - start) * 1e-9;
+		return result;
+	}
+
+	// Client -> MIDI out.
+	Result RunOutbound(VirtualMidiBackend& backend, Client& client, const Shape& shape, double duration)
+	{
+		std::unique_ptr<std::atomic<int64_t>[]> sendTimes(new std::atomic<int64_t>[sequenceSpace]);
+
+		Result result;
+		result.direction = "out";
+		result.transport = client.GetName();
+		result.shape = shape;
+		result.received = 0;
+
+		backend.TakeCaptures();
+
+		// Gather the captures while sending so that the capture buffer doesn't fill up.
+		std::atomic<bool> sending(true);
+		int64_t lastReceive = 0;
+		std::thread collector([&]()
+		{
+			auto idleLimit = 0LL;
+			while (true)
+			{
+				auto captures = backend.TakeCaptures();
+				auto now = GetNanoseconds();
+
+				for (auto& capture : captures)
+				{
+					uint8_t bytes[3] = { static_cast<uint8_t>(capture.raw32), static_cast<uint8_t>(capture.raw32 >> 8), static_cast<uint8_t>(capture.raw32 >> 16) };
+					auto time = ToNanoseconds(capture.time);
+					result.latencies.push_back((time - sendTimes[DecodeSequence(bytes)].load(std::memory_order_relaxed)) * 1e-3);
+					result.received++;
+					lastReceive = std::max(lastReceive, time);
+				}
+
+				if (captures.empty())
+				{
+					if (!sending && idleLimit == 0) idleLimit = now + 200000000LL;
+					if (idleLimit != 0 && now >= idleLimit) break;
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+				else if (!sending)
+				{
+					idleLimit = 0;
+				}
+			}
+		});
+
+		auto start = GetNanoseconds();
+		result.sent = RunPacer(shape, duration, [&](uint32_t sequence)
+		{
+			MidiMessage message(EncodeSequence(sequence));
+			sendTimes[sequence & (sequenceSpace - 1)].store(GetNanoseconds(), std::memory_order_relaxed);
+			client.Send(message.bytes, sizeof(message.bytes));
+		});
+		sending = false;
+		collector.join();
+
+		result.seconds = ((lastReceive > 0 ? lastReceive : GetNanoseconds()) - start) * 1e-9;
+		return result;
+	}
+
+	void PrintResult(const Result& result, bool last)
+	{
+		std::vector<double> sorted(result.latencies);
+		std::sort(sorted.begin(), sorted.end());
+
+		double throughput = result.seconds > 0 ? result.received / result.seconds : 0;
+		printf("    { \"direction\": \"%s\", \"transport\": \"%s\", \"shape\": \"%s\", \"rate\": %.0f, \"burst\": %d, "
+			   "\"sent\": %llu, \"received\": %llu, \"messages_per_second\": %.0f, "
+			   "\"latency_us\": { \"p50\": %.1f, \"p99\": %.1f, \"p99_9\": %.1f, \"max\": %.1f } }%s\n",
+			   result.direction.c_str(), result.transport.c_str(), result.shape.name, result.shape.rate, result.shape.burstSize,
+			   static_cast<unsigned long long>(result.sent), static_cast<unsigned long long>(result.received), throughput,
+			   GetPercentile(sorted, 50), GetPercentile(sorted, 99), GetPercentile(sorted, 99.9),
+			   sorted.empty() ? 0.0 : sorted.back(), last ? "" : ",");
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Platform::Initialize();
+
+	// Parse the options.
+	double duration = 1.0;
+	std::vector<std::string> transports;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg(argv[i]);
+		if (arg == "-duration" && i + 1 < argc)
+		{
+			duration = atof(argv[++i]);
+		}
+		else if (arg == "-transport" && i + 1 < argc)
+		{
+			transports.push_back(argv[++i]);
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [-duration seconds] [-transport tcp|shm]...\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (transports.empty()) transports = { "tcp", "shm" };
+
+	static const Shape shapes[] =
+	{
+		{ "steady", 1000, 1 },
+		{ "steady", 10000, 1 },
+		{ "steady", 100000, 1 },
+		{ "burst", 10000, 64 },
+		{ "burst", 10000, 1024 },
+		{ "flood", 0, 1 },
+	};
+
+	// Large enough to capture a flood between two collections.
+	VirtualMidiBackend backend(1, 1, 1 << 20);
+	BridgeApp app(backend);
+	app.Start();
+
+	std::vector<Result> results;
+	for (auto& transport : transports)
+	{
+		for (auto& shape : shapes)
+		{
+			for (int direction = 0; direction < 2; direction++)
+			{
+				// A fresh connection for every run keeps the queues empty.
+				auto client = CreateClient(transport);
+				if (!client->Connect())
+				{
+					fprintf(stderr, "Failed to connect to the bridge with %s.\n", transport.c_str());
+					app.Stop();
+					return EXIT_FAILURE;
+				}
+
+				fprintf(stderr, "%s %s %s %.0f/%d...\n", direction == 0 ? "in" : "out", transport.c_str(), shape.name, shape.rate, shape.burstSize);
+				if (direction == 0)
+				{
+					results.push_back(RunInbound(backend, *client, shape, duration));
+				}
+				else
+				{
+					results.push_back(RunOutbound(backend, *client, shape, duration));
+				}
+			}
+		}
+	}
+
+	app.Stop();
+
+	puts("{");
+	puts("  \"benchmark\": \"midibridge-e2e\",");
+	printf("  \"duration_s\": %.3f,\n", duration);
+	puts("  \"results\": [");
+	for (size_t i = 0; i < results.size(); i++) PrintResult(results[i], i + 1 == results.size());
+	puts("  ]");
+	puts("}");
+
+	Platform::Finalize();
+	return 0;
+}
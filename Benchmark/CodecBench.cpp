@@ -0,0 +1,153 @@
+// Microbenchmark for the MidiMessage codec.
+//
+// Converts a block of random driver dwords to wire records and back with:
+//
+//   branching : the original status byte branch chains, one message at a time
+//   scalar    : MidiMessage(uint32_t) / GetRaw32() (table-driven, branchless)
+//   batch     : MidiCodec::Encode / Decode (SIMD where available)
+//
+// The results are checked against each other and printed as JSON on the
+// standard output.
+
+#include "stdafx.h"
+#include "MidiCodec.h"
+
+namespace
+{
+	// The codec before the status table, kept as the baseline.
+	MidiMessage EncodeBranching(uint32_t raw32)
+	{
+		MidiMessage message;
+		uint8_t status = raw32 & 0xff;
+		uint8_t eventType = status >> 4;
+
+		message.bytes[0] = status;
+		message.bytes[3] = 0xff;
+
+		if (eventType == 0xc || eventType == 0xd || status == 0xf1 || status == 0xf3)
+		{
+			message.bytes[1] = (raw32 >> 8) & 0xff;
+			message.bytes[2] = 0xff;
+		}
+		else if (eventType != 0xf || status == 0xf2)
+		{
+			message.bytes[1] = (raw32 >> 8) & 0xff;
+			message.bytes[2] = (raw32 >> 16) & 0xff;
+		}
+		else
+		{
+			message.bytes[1] = 0xff;
+			message.bytes[2] = 0xff;
+		}
+		return message;
+	}
+
+	uint32_t DecodeBranching(const MidiMessage& message)
+	{
+		uint32_t temp = message.bytes[0];
+		if (message.bytes[1] < 0x80) temp += message.bytes[1] << 8;
+		if (message.bytes[2] < 0x80) temp += message.bytes[2] << 16;
+		return temp;
+	}
+
+	int64_t GetNanoseconds()
+	{
+		auto now = std::chrono::steady_clock::now().time_since_epoch();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+	}
+
+	// Best time of the repeats in nanoseconds per message.
+	template <typename Function>
+	double Measure(int repeat, size_t count, Function function)
+	{
+		int64_t best = INT64_MAX;
+		for (int i = 0; i < repeat; i++)
+		{
+			int64_t start = GetNanoseconds();
+			function();
+			best = std::min(best, GetNanoseconds() - start);
+		}
+		return static_cast<double>(best) / count;
+	}
+
+	uint32_t Checksum(const void* data, size_t length)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		uint32_t sum = 2166136261U;
+		for (size_t i = 0; i < length; i++) sum = (sum ^ bytes[i]) * 16777619U;
+		return sum;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t count = 1 << 20;
+	int repeat = 10;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "-count" && i + 1 < argc) count = static_cast<size_t>(std::stoul(argv[++i]));
+		else if (arg == "-repeat" && i + 1 < argc) repeat = std::max(1, std::stoi(argv[++i]));
+	}
+
+	// Random dwords over the whole status range, including the data bytes
+	// with the top bit set (the padding cases).
+	std::vector<uint32_t> raw(count);
+	uint32_t seed = 12345;
+	for (auto& value : raw)
+	{
+		seed = seed * 1664525U + 1013904223U;
+		value = seed;
+	}
+
+	std::vector<MidiMessage> branchingMessages(count), scalarMessages(count), batchMessages(count);
+	std::vector<uint32_t> branchingRaw(count), scalarRaw(count), batchRaw(count);
+
+	double encodeBranching = Measure(repeat, count, [&]
+	{
+		for (size_t i = 0; i < count; i++) branchingMessages[i] = EncodeBranching(raw[i]);
+	});
+	double encodeScalar = Measure(repeat, count, [&]
+	{
+		MidiCodec::EncodeScalar(raw.data(), scalarMessages.data(), count);
+	});
+	double encodeBatch = Measure(repeat, count, [&]
+	{
+		MidiCodec::Encode(raw.data(), batchMessages.data(), count);
+	});
+
+	double decodeBranching = Measure(repeat, count, [&]
+	{
+		for (size_t i = 0; i < count; i++) branchingRaw[i] = DecodeBranching(branchingMessages[i]);
+	});
+	double decodeScalar = Measure(repeat, count, [&]
+	{
+		MidiCodec::DecodeScalar(branchingMessages.data(), scalarRaw.data(), count);
+	});
+	double decodeBatch = Measure(repeat, count, [&]
+	{
+		MidiCodec::Decode(branchingMessages.data(), batchRaw.data(), count);
+	});
+
+	size_t messageBytes = count * sizeof(MidiMessage);
+	size_t rawBytes = count * sizeof(uint32_t);
+	bool match =
+		Checksum(branchingMessages.data(), messageBytes) == Checksum(scalarMessages.data(), messageBytes) &&
+		Checksum(branchingMessages.data(), messageBytes) == Checksum(batchMessages.data(), messageBytes) &&
+		Checksum(branchingRaw.data(), rawBytes) == Checksum(scalarRaw.data(), rawBytes) &&
+		Checksum(branchingRaw.data(), rawBytes) == Checksum(batchRaw.data(), rawBytes);
+
+	printf("{\n");
+	printf("  \"benchmark\": \"midibridge-codec\",\n");
+	printf("  \"instruction_set\": \"%s\",\n", MidiCodec::GetInstructionSet());
+	printf("  \"messages\": %llu,\n", static_cast<unsigned long long>(count));
+	printf("  \"match\": %s,\n", match ? "true" : "false");
+	printf("  \"ns_per_message\": {\n");
+	printf("    \"encode_branching\": %.3f, \"encode_scalar\": %.3f, \"encode_batch\": %.3f,\n", encodeBranching, encodeScalar, encodeBatch);
+	printf("    \"decode_branching\": %.3f, \"decode_scalar\": %.3f, \"decode_batch\": %.3f\n", decodeBranching, decodeScalar, decodeBatch);
+	printf("  }\n");
+	printf("}\n");
+
+	return match ? 0 : 1;
+}
@@ -4,50 +4,232 @@
 #include "IpcServer.h"
 #include "MidiClient.h"
 #include "Logger.h"
+#include "MessageQueue.h"
+#include "SessionCapture.h"
+#include "MessageCoalescer.h"
+#include "MidiStateCache.h"
+#include "OutputScheduler.h"
+#include "Metrics.h"
+#include "MetricsEndpoint.h"
+#include "ControlEndpoint.h"
+#include "ClockTracker.h"
+#include "TransformTable.h"
 
 // Application class.
 class BridgeApp
-    : public MidiClient::MessageDelegate, IpcServer::MessageDelegate
+    : public MidiClient::MessageDelegate, public IpcServer::MessageDelegate, public OutputScheduler::MessageDelegate,
+      public MetricsEndpoint::ReportDelegate, public ControlEndpoint::CommandDelegate
 {
 public:
 
-    BridgeApp()
-        : ipcServer(*this), midiClient(*this)
+	// Application settings.
+	struct Settings
+	{
+		// Max number of messages gathered into a single send.
+		int maxBatch;
+
+		// Max time to wait for more messages before sending a batch (microseconds).
+		int maxDelay;
+
+		// Window for thinning the controller messages (microseconds, 0 = off).
+		// The batch waits for the window and keeps the last value per controller.
+		int coalesceWindow;
+
+		// IPC server settings.
+		IpcServer::Settings ipc;
+
+		// Session capture file (none if empty).
+		std::basic_string<_TCHAR> capturePath;
+
+		// Routing file (broadcast if empty).
+		std::basic_string<_TCHAR> routingPath;
+
+		// Transform file (messages unchanged if empty).
+		std::basic_string<_TCHAR> transformPath;
+
+		// Interval of the device list polling (milliseconds, 0 = off).
+		int deviceWatchInterval;
+
+		// Port of the local metrics endpoint (0 = off).
+		int metricsPort;
+
+		// Clock and time code delivery to the clients.
+		ClockTracker::Mode clockMode;
+
+		// Port of the local control endpoint in the daemon mode (0 = off).
+		int controlPort;
+
+		Settings()
+			: maxBatch(256), maxDelay(0), coalesceWindow(0), deviceWatchInterval(1000), metricsPort(0), clockMode(ClockTracker::Mode::Raw),
+			  controlPort(ControlEndpoint::defaultPortNumber)
+		{
+		}
+	};
+
+    BridgeApp(MidiBackend& midiBackend, const Settings& settings = Settings())
+        : settings(settings), routing(std::make_shared<RoutingTable>()), inputQueue(inputQueueSize), sysExRecycleQueue(sysExRecycleQueueSize), ipcServer(*this, settings.ipc), midiClient(*this, midiBackend), scheduler(*this), metricsEndpoint(*this), controlEndpoint(*this)
+    {
+        stopSenderThread = false;
+    }
+
+    ~BridgeApp()
     {
+        StopSender();
     }
 
     // Main loop: automatic mode.
 	void RunAutomatic()
 	{
-		// Initialize the MIDI client.
-		midiClient.OpenAllDevices();
+		Start();
 		midiClient.PrintDeviceList();
 
 		Logger::Enable();
-		
-		// Start IPC.
-		ipcServer.SetUp();
-		ipcServer.Start();
 
 		while (true)
 		{
 			GetLine();
 
-			// Rescan and grab the MIDI devices.
-			midiClient.CloseAllDevices();
-			midiClient.OpenAllDevices();
+			// Rescan: grab the new MIDI devices, keep the working ones.
+			midiClient.RescanDevices();
 		}
 	}
 
-	// Main loop: interactive mode.
-	void RunInteractive()
+	// Main loop: daemon mode. No console: driven by the control events
+	// (signals, console events on Windows) and the control endpoint until
+	// a stop is requested. Returns the exit code.
+	int RunDaemon()
 	{
-		// Initialize the MIDI client.
+		// A failure stops the daemon in order instead of exiting.
+		Debug::SetFailureHandler(&Platform::RequestStop);
+
+		bool started = Debug::Assert(Platform::InstallControlHandlers(), "Failed to install the control handlers.") && Start();
+		if (started && settings.controlPort > 0)
+		{
+			started = Debug::Assert(controlEndpoint.Start(settings.controlPort), "Failed to open the control endpoint.");
+		}
+		if (started)
+		{
+			midiClient.PrintDeviceList();
+			PrintDaemonStatus("Running.");
+		}
+
+		while (started)
+		{
+			Platform::ClearControlWake();
+			Platform::ControlEvent event = Platform::TakeControlEvent();
+			if (event == Platform::ControlEvent::Stop) break;
+
+			if (event == Platform::ControlEvent::None)
+			{
+				// Sleeps until an event is posted, serving the control connections.
+				controlEndpoint.Poll(Platform::GetControlWakeHandle(), -1);
+			}
+			else
+			{
+				fputs(ProcessControlEvent(event).c_str(), stdout);
+				fflush(stdout);
+			}
+		}
+
+		// The input and the pending messages are drained on the way out.
+		PrintDaemonStatus("Stopping.");
+		controlEndpoint.Stop();
+		Stop();
+		Debug::SetFailureHandler(nullptr);
+		PrintDaemonStatus("Stopped.");
+		Platform::NotifyStopped();
+		return started ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// Start/stop the bridge without the console (benchmarks and embedding).
+	// Start returns false if a part failed to start (only when the Debug
+	// failure handler is set); Stop cleans up what was started.
+	bool Start()
+	{
+		if (!settings.routingPath.empty() && !Debug::Assert(LoadRouting(), "Failed to load the routing file.")) return false;
+		if (!settings.transformPath.empty() && !Debug::Assert(LoadTransforms(), "Failed to load the transform file.")) return false;
+
+		if (!settings.capturePath.empty() &&
+			!Debug::Assert(capture.Start(settings.capturePath.c_str()), "Failed to open the capture file.")) return false;
+
+		// The sender runs whenever a device is open: it releases the SysEx
+		// buffers, which the devices wait for when they close. Until the IPC
+		// server starts, it has no client to send to.
+		StartSender();
 		midiClient.OpenAllDevices();
+		if (settings.deviceWatchInterval > 0) midiClient.StartDeviceWatcher(settings.deviceWatchInterval);
+		scheduler.Start();
+		if (settings.metricsPort > 0 &&
+			!Debug::Assert(metricsEndpoint.Start(settings.metricsPort), "Failed to open the metrics endpoint.")) return false;
 
-		// Start IPC.
-		ipcServer.SetUp();
-		ipcServer.Start();
+		return ipcServer.SetUp() && ipcServer.Start();
+	}
+
+	// The devices are closed before the sender stops, so that it can hand
+	// their last messages to the clients.
+	void Stop()
+	{
+		metricsEndpoint.Stop();
+		midiClient.StopDeviceWatcher();
+		scheduler.Stop();
+		midiClient.CloseAllDevices();
+		StopSender();
+		ipcServer.StopAndWait();
+		capture.Stop();
+	}
+
+	// Reload the routing file. The current routing stays on an error.
+	bool LoadRouting()
+	{
+		if (settings.routingPath.empty()) return false;
+
+		std::shared_ptr<RoutingTable> table = std::make_shared<RoutingTable>();
+		std::string error;
+		if (!table->Load(settings.routingPath.c_str(), error))
+		{
+			printf("Routing: %s\n", error.c_str());
+			return false;
+		}
+
+		// Applied from the next message on; nothing is paused.
+		std::shared_ptr<const RoutingTable> published = table;
+		std::atomic_store(&routing, published);
+		return true;
+	}
+
+	// Reload the transform file. The current transforms stay on an error.
+	bool LoadTransforms()
+	{
+		if (settings.transformPath.empty()) return false;
+
+		std::shared_ptr<TransformTable> table = std::make_shared<TransformTable>();
+		std::string error;
+		if (!table->Load(settings.transformPath.c_str(), error))
+		{
+			printf("Transforms: %s\n", error.c_str());
+			return false;
+		}
+
+		// Applied from the next message on; nothing is paused.
+		std::shared_ptr<const TransformTable> published = table;
+		std::atomic_store(&transforms, published);
+		return true;
+	}
+
+	// Reload the configuration files. Nothing is restarted, so the clients
+	// and the devices stay connected; a file with an error is skipped.
+	bool ReloadConfiguration()
+	{
+		bool result = true;
+		if (!settings.routingPath.empty()) result = LoadRouting() && result;
+		if (!settings.transformPath.empty()) result = LoadTransforms() && result;
+		return result;
+	}
+
+	// Main loop: interactive mode.
+	void RunInteractive()
+	{
+		Start();
 
 		while (true)
 		{
@@ -55,7 +237,7 @@ public:
 			midiClient.PrintDeviceList();
 
 			// Command line.
-			puts("Enter an ID or one of the following commands: (s)can, (r)eset, (l)og, (q)uit");
+			puts("Enter an ID or one of the following commands: (s)can, (r)eset, (m)atrix reload, trans(f)orms reload, (o)utput stats, s(t)ats, (l)og, (q)uit");
 			auto input = GetLine();
 
 			if (input[0] >= '0' && input[0] <= '9')
@@ -63,11 +245,35 @@ public:
 				// ID number: switch the state of the device.
 				midiClient.TrySwitchState(atoi(input.c_str()));
 			}
+			else if (input[0] == 's')
+			{
+				// Scan: open the new MIDI devices and close the vanished ones.
+				midiClient.RescanDevices();
+			}
 			else if (input[0] == 'r')
 			{
-				// Reset: rescan and grab the all MIDI devices.
-				midiClient.CloseAllDevices();
-				midiClient.OpenAllDevices();
+				// Reset: close and reopen the all MIDI devices.
+				midiClient.ReopenAllDevices();
+			}
+			else if (input[0] == 'm')
+			{
+				// Matrix: reload the routing file.
+				if (LoadRouting()) puts("Routing reloaded.");
+			}
+			else if (input[0] == 'f')
+			{
+				// Transforms: reload the transform file.
+				if (LoadTransforms()) puts("Transforms reloaded.");
+			}
+			else if (input[0] == 'o')
+			{
+				// Output stats: queue depth and driver time per output device.
+				midiClient.PrintOutputStats();
+			}
+			else if (input[0] == 't')
+			{
+				// Stats: the metrics report.
+				fputs(GetMetricsReport().c_str(), stdout);
 			}
 			else if (input[0] == 'l')
 			{
@@ -87,32 +293,382 @@ public:
 		}
 
 		// Cleaning up.
-		midiClient.CloseAllDevices();
-		ipcServer.StopAndWait();
+		Stop();
 	}
 
 private:
 
+	Settings settings;
+
+	// Current routing matrix. Replaced as a whole and read without locking.
+	std::shared_ptr<const RoutingTable> routing;
+
+	// Current transforms, null if none. Published like the routing.
+	std::shared_ptr<const TransformTable> transforms;
+
+	// Queue of the incoming MIDI messages waiting to be sent to the clients.
+	// Declared first so that it outlives the device callbacks.
+	static const size_t inputQueueSize = 4096;
+	MessageQueue<MidiEvent> inputQueue;
+
+	// SysEx buffers the device callbacks can't pass on (empty, dropped or
+	// overflowed), released by the sender: a release may give the buffer
+	// back to the driver, which can't be called from a callback. Larger
+	// than the device buffers in all, so it never fills.
+	static const size_t sysExRecycleQueueSize = 1024;
+	MessageQueue<SysExBuffer*> sysExRecycleQueue;
+
+	// Recorder of the traffic for a later replay. Also outlives the callbacks.
+	SessionCapture capture;
+
 	IpcServer ipcServer;
 	MidiClient midiClient;
+
+	// Client messages waiting for their time. Emits through midiClient.
+	OutputScheduler scheduler;
+
+	MetricsEndpoint metricsEndpoint;
+
+	// Commands to the daemon. Served by the daemon loop.
+	ControlEndpoint controlEndpoint;
+
+	// Sender thread which drains the input queue.
+	std::thread senderThread;
+	std::atomic<bool> stopSenderThread;
 	
 	// IPC -> MIDI out
-    int ProcessIncomingIpcMessageFromClient(const uint8_t* data, int offset, int length)
+    // A run of messages is routed with one routing snapshot and sent as a batch.
+    void ProcessIncomingIpcMessagesFromClient(int client, const uint8_t* data, int count) override
     {
-        Debug::Assert(offset + 4 <= length, "Invalid IPC message.");
-        MidiMessage message(data + offset);
-        midiClient.SendMessageToDevices(message);
-		Logger::RecordMidiOutput(message);
-        return offset + 4;
+        static const int chunkSize = 64;
+        MidiMessage messages[chunkSize];
+        uint64_t outputMasks[chunkSize];
+
+        auto table = std::atomic_load(&routing);
+        auto transform = std::atomic_load(&transforms);
+        uint64_t timestamp = Platform::GetTimestamp();
+        Metrics::Get().clientMessages.Add(count);
+
+        for (int offset = 0; offset < count; offset += chunkSize)
+        {
+            int chunk = std::min(chunkSize, count - offset);
+            int kept = 0;
+            for (int i = 0; i < chunk; i++)
+            {
+                // Captured as received: a replay goes through the transforms again.
+                MidiMessage& message = messages[kept];
+                message = MidiMessage(data + (offset + i) * 4);
+                capture.Record(SessionFormat::Kind::ClientMessage, static_cast<uint8_t>(client), message, timestamp);
+
+                // A dropped message is overwritten by the next one.
+                if (transform && !transform->output.Apply(message)) continue;
+                outputMasks[kept++] = table->GetOutputs(client, message.bytes[0]);
+                Logger::RecordMidiOutput(message);
+            }
+            if (kept < chunk) Metrics::Get().transformDrops.Add(chunk - kept);
+            midiClient.SendMessagesToDevices(messages, outputMasks, kept);
+        }
     }
 
-    // MIDI in -> IPC
-    void ProcessIncomingMidiMessageFromDevice(MidiMessage message) override
+    void ProcessIncomingSysExFromClient(int client, const uint8_t* data, int length) override
     {
-		Logger::RecordMidiInput(message);
-        ipcServer.SendToClient(message);
+        Metrics::Get().clientSysEx.Add();
+        capture.RecordSysEx(SessionFormat::Kind::ClientSysEx, static_cast<uint8_t>(client), data, length, Platform::GetTimestamp());
+        auto transform = std::atomic_load(&transforms);
+        if (transform && !transform->output.PassesSysEx())
+        {
+            Metrics::Get().transformDrops.Add();
+            return;
+        }
+        midiClient.SendSysExToDevices(data, length, std::atomic_load(&routing)->GetOutputs(client, 0xf0));
+        MidiMessage message(0xf0);
+        Logger::RecordMidiOutput(message);
     }
 
+    // Timed message: held by the scheduler until its time. One already due
+    // goes through it as well, so that it can't overtake an earlier one;
+    // it is dropped (and counted) if the scheduler is full.
+    void ProcessTimedMessageFromClient(int client, uint64_t time, const uint8_t* data) override
+    {
+        Metrics::Get().clientTimedMessages.Add();
+        scheduler.Schedule(time, client, MidiMessage(data));
+    }
+
+    // Scheduled message due (scheduler thread). Captured at this point so
+    // that a replay keeps the timing.
+    void ProcessScheduledMessage(int client, const MidiMessage& scheduled) override
+    {
+        capture.Record(SessionFormat::Kind::ClientMessage, static_cast<uint8_t>(client), scheduled, Platform::GetTimestamp());
+
+        MidiMessage message = scheduled;
+        auto transform = std::atomic_load(&transforms);
+        if (transform && !transform->output.Apply(message))
+        {
+            Metrics::Get().transformDrops.Add();
+            return;
+        }
+        midiClient.SendMessageToDevices(message, std::atomic_load(&routing)->GetOutputs(client, message.bytes[0]));
+        Logger::RecordMidiOutput(message);
+    }
+
+    // Metrics report: the hot path metrics and the state of the components.
+    std::string GetMetricsReport() override
+    {
+        std::string text;
+        Metrics::Get().Report(text);
+
+        Metrics::AppendLine(text, "ipc.clients", ipcServer.GetClientCount());
+        Metrics::AppendLine(text, "ipc.dropped_bytes", ipcServer.GetDroppedByteCount());
+        Metrics::AppendLine(text, "scheduler.pending", scheduler.GetPendingCount());
+        Metrics::AppendLine(text, "scheduler.late", scheduler.GetLateCount());
+        Metrics::AppendLine(text, "scheduler.drops", scheduler.GetDroppedCount());
+        Metrics::AppendLine(text, "output.deferred", midiClient.GetDeferredMessageCount());
+        Metrics::AppendLine(text, "output.deferred_drops", midiClient.GetDeferredDropCount());
+        Metrics::AppendLine(text, "log.drops", Logger::GetDroppedCount());
+        Metrics::AppendLine(text, "capture.drops", capture.GetDroppedCount());
+
+        for (auto& port : midiClient.GetOutputStats())
+        {
+            std::string prefix = "output." + std::to_string(port.id) + ".";
+            Metrics::AppendLine(text, prefix + "depth", port.depth);
+            Metrics::AppendLine(text, prefix + "sent", port.sent);
+            Metrics::AppendLine(text, prefix + "drops", port.dropped);
+            Metrics::AppendLine(text, prefix + "send_time_max_us", port.sendTimeMax);
+        }
+        return text;
+    }
+
+    // Control event from the system or the control endpoint (daemon loop).
+    // Returns the reply.
+    std::string ProcessControlEvent(Platform::ControlEvent event)
+    {
+        switch (event)
+        {
+        case Platform::ControlEvent::Stop:
+            Platform::RequestStop();
+            return "Stopping.\n";
+        case Platform::ControlEvent::Reload:
+            return ReloadConfiguration() ? "Configuration reloaded.\n" : "Failed to reload the configuration.\n";
+        case Platform::ControlEvent::Rescan:
+            midiClient.RescanDevices();
+            return "Devices rescanned.\n";
+        case Platform::ControlEvent::Stats:
+            return GetMetricsReport();
+        default:
+            return std::string();
+        }
+    }
+
+    // Command line from the control endpoint (daemon loop).
+    std::string ProcessControlCommand(const std::string& command) override
+    {
+        if (command == "stop") return ProcessControlEvent(Platform::ControlEvent::Stop);
+        if (command == "reload") return ProcessControlEvent(Platform::ControlEvent::Reload);
+        if (command == "rescan") return ProcessControlEvent(Platform::ControlEvent::Rescan);
+        if (command == "stats") return ProcessControlEvent(Platform::ControlEvent::Stats);
+        return "Unknown command: " + command + " (stop, reload, rescan, stats)\n";
+    }
+
+    static void PrintDaemonStatus(const char* status)
+    {
+        printf("MidiBridge: %s\n", status);
+        fflush(stdout);
+    }
+
+    // New client: wake up the sender to send the snapshot.
+    void ProcessNewIpcClient() override
+    {
+		inputQueue.Notify();
+    }
+
+    // MIDI in -> queue (called from the driver callback)
+    // Captured before the transforms, so that a replay goes through them again.
+    void ProcessIncomingMidiMessageFromDevice(const MidiEvent& event) override
+    {
+		capture.Record(SessionFormat::Kind::DeviceInput, event.device, event.message, event.timestamp);
+		Metrics::Get().deviceMessages.Add();
+
+		MidiEvent transformed = event;
+		auto transform = std::atomic_load(&transforms);
+		if (transform && !transform->input.Apply(transformed.message))
+		{
+			Metrics::Get().transformDrops.Add();
+			return;
+		}
+		if (!inputQueue.TryPush(transformed)) Metrics::Get().inputDrops.Add();
+    }
+
+    // The buffer goes through the queue and is released by the sender.
+    void ProcessIncomingSysExFromDevice(const MidiEvent& event) override
+    {
+		// An empty buffer only comes to be released.
+		if (event.sysex->length == 0)
+		{
+			DeferSysExRelease(event.sysex);
+			return;
+		}
+
+		capture.RecordSysEx(SessionFormat::Kind::DeviceSysEx, event.device, event.sysex->data, event.sysex->length, event.timestamp);
+		Metrics::Get().deviceSysEx.Add();
+		auto transform = std::atomic_load(&transforms);
+		if (transform && !transform->input.PassesSysEx())
+		{
+			Metrics::Get().transformDrops.Add();
+			DeferSysExRelease(event.sysex);
+			return;
+		}
+		if (!inputQueue.TryPush(event))
+		{
+			Metrics::Get().inputDrops.Add();
+			DeferSysExRelease(event.sysex);
+		}
+    }
+
+	// Hand a SysEx buffer to the sender for releasing (device callbacks).
+	void DeferSysExRelease(SysExBuffer* buffer)
+	{
+		if (!sysExRecycleQueue.TryPush(buffer))
+		{
+			// Can't happen with the queue larger than the buffers.
+			buffer->Release();
+			return;
+		}
+		inputQueue.Notify();
+	}
+
+	// Release the buffers handed over by the callbacks (sender thread).
+	void ReleaseDeferredSysEx()
+	{
+		SysExBuffer* buffer;
+		while (sysExRecycleQueue.TryPop(buffer)) buffer->Release();
+	}
+
+	// Start/stop the sender thread.
+	void StartSender()
+	{
+		stopSenderThread = false;
+		senderThread = std::thread(&BridgeApp::RunSenderLoop, this);
+	}
+
+	void StopSender()
+	{
+		if (senderThread.joinable())
+		{
+			stopSenderThread = true;
+			inputQueue.Notify();
+			senderThread.join();
+		}
+	}
+
+	// Queue -> IPC
+	void RunSenderLoop()
+	{
+		// A coalescing window gathers up to the whole queue.
+		bool coalescing = settings.coalesceWindow > 0;
+		int maxDelay = std::max(settings.maxDelay, settings.coalesceWindow);
+		std::vector<MidiEvent> batch(std::max<int>(coalescing ? inputQueueSize : 1, settings.maxBatch));
+		int maxBatch = static_cast<int>(batch.size());
+		uint64_t reportedOverflow = 0;
+		MessageCoalescer coalescer;
+
+		// State of the inputs as seen by the clients.
+		MidiStateCache stateCache;
+		std::vector<MidiEvent> snapshot;
+
+		// Clock sources, followed unless the raw messages are all the clients want.
+		bool trackingClock = settings.clockMode != ClockTracker::Mode::Raw;
+		bool removingTicks = settings.clockMode == ClockTracker::Mode::Tempo;
+		ClockTracker clockTracker;
+		std::vector<ClockTracker::Update> clockUpdates;
+
+		// On a stop, the queue is drained before leaving.
+		while (!stopSenderThread || !inputQueue.IsEmpty())
+		{
+			ReleaseDeferredSysEx();
+
+			// Gather the pending messages.
+			int count = 0;
+			while (count < maxBatch && inputQueue.TryPop(batch[count])) count++;
+
+			// Give the burst a chance to grow if a delay is allowed.
+			if (count > 0 && count < maxBatch && maxDelay > 0)
+			{
+				auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(maxDelay);
+				while (count < maxBatch && !stopSenderThread)
+				{
+					if (inputQueue.TryPop(batch[count]))
+					{
+						count++;
+						continue;
+					}
+					auto now = std::chrono::steady_clock::now();
+					if (now >= deadline) break;
+					inputQueue.Wait(deadline - now);
+				}
+			}
+
+			// Bring the new clients up to date before they get this batch.
+			if (ipcServer.IsSnapshotPending())
+			{
+				stateCache.GetSnapshot(Platform::GetTimestamp(), snapshot);
+				ipcServer.SendSnapshots(snapshot.data(), static_cast<int>(snapshot.size()), *std::atomic_load(&routing));
+			}
+
+			for (int i = 0; i < count; i++) stateCache.Update(batch[i]);
+
+			if (count > 0 && trackingClock)
+			{
+				clockUpdates.clear();
+				for (int i = 0; i < count; i++) clockTracker.Process(batch[i], clockUpdates);
+				if (removingTicks) count = static_cast<int>(std::remove_if(batch.begin(), batch.begin() + count, ClockTracker::IsTickEvent) - batch.begin());
+			}
+
+			if (count > 0 && coalescing) count = coalescer.Thin(batch.data(), count);
+
+			if (count > 0)
+			{
+				for (int i = 0; i < count; i++) Logger::RecordMidiInput(batch[i].message);
+				ipcServer.SendToClients(batch.data(), count, *std::atomic_load(&routing));
+			}
+
+			// The clock states follow the messages they were computed from.
+			if (!clockUpdates.empty())
+			{
+				ipcServer.SendClockUpdates(clockUpdates.data(), static_cast<int>(clockUpdates.size()), *std::atomic_load(&routing));
+				Metrics::Get().clockUpdates.Add(clockUpdates.size());
+				clockUpdates.clear();
+			}
+
+			if (count > 0)
+			{
+
+				uint64_t now = Platform::GetTimestamp();
+				Metrics& metrics = Metrics::Get();
+				metrics.batchSize.Record(count);
+				for (int i = 0; i < count; i++) metrics.inputLatency.Record(now - std::min(now, batch[i].timestamp));
+
+				// The SysEx buffers are no longer referenced.
+				for (int i = 0; i < count; i++)
+				{
+					if (batch[i].sysex != nullptr) batch[i].sysex->Release();
+				}
+				continue;
+			}
+
+			// Report the messages dropped by the overflow.
+			uint64_t overflow = inputQueue.GetOverflowCount();
+			if (overflow != reportedOverflow)
+			{
+				Logger::RecordMisc("MIDI input queue overflowed (%llu messages dropped in total).", static_cast<unsigned long long>(overflow));
+				reportedOverflow = overflow;
+			}
+
+			inputQueue.Wait(std::chrono::milliseconds(100));
+		}
+
+		ReleaseDeferredSysEx();
+	}
+
 	// Utility: get a line from stdin.
 	static std::string GetLine()
 	{
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "stdafx.h"
+
+// Fixed-capacity circular byte buffer (single thread or externally locked).
+class ByteRing
+{
+public:
+
+	ByteRing(size_t capacity)
+		: buffer(capacity), head(0), size(0)
+	{
+	}
+
+	size_t GetCapacity() const
+	{
+		return buffer.size();
+	}
+
+	size_t GetSize() const
+	{
+		return size;
+	}
+
+	size_t GetFreeSpace() const
+	{
+		return buffer.size() - size;
+	}
+
+	bool IsEmpty() const
+	{
+		return size == 0;
+	}
+
+	// Append data. Writes nothing and returns false if it doesn't fit.
+	bool Write(const void* data, size_t length)
+	{
+		if (length > GetFreeSpace()) return false;
+
+		const uint8_t* source = static_cast<const uint8_t*>(data);
+		size_t tail = (head + size) % buffer.size();
+		size_t first = std::min(length, buffer.size() - tail);
+
+		memcpy(&buffer[tail], source, first);
+		memcpy(&buffer[0], source + first, length - first);
+
+		size += length;
+		return true;
+	}
+
+	// Take back the last data written.
+	void Unwrite(size_t length)
+	{
+		size -= length;
+		if (size == 0) head = 0;
+	}
+
+	// Contiguous readable region at the head.
+	const uint8_t* GetReadPointer(size_t& length) const
+	{
+		length = std::min(size, buffer.size() - head);
+		return buffer.data() + head;
+	}
+
+	// Copy data from the head without consuming it. Returns false if there isn't enough.
+	bool Peek(void* data, size_t length) const
+	{
+		if (length > size) return false;
+
+		uint8_t* destination = static_cast<uint8_t*>(data);
+		size_t first = std::min(length, buffer.size() - head);
+
+		memcpy(destination, &buffer[head], first);
+		memcpy(destination + first, &buffer[0], length - first);
+		return true;
+	}
+
+	// Contiguous writable region at the tail.
+	uint8_t* GetWritePointer(size_t& length)
+	{
+		size_t tail = (head + size) % buffer.size();
+		length = std::min(GetFreeSpace(), buffer.size() - tail);
+		return buffer.data() + tail;
+	}
+
+	// Mark data as written into the region given by GetWritePointer.
+	void Commit(size_t length)
+	{
+		size += length;
+	}
+
+	// Discard data from the head.
+	void Consume(size_t length)
+	{
+		head = (head + length) % buffer.size();
+		size -= length;
+		if (size == 0) head = 0;
+	}
+
+	void Clear()
+	{
+		head = size = 0;
+	}
+
+private:
+
+	std::vector<uint8_t> buffer;
+	size_t head;
+	size_t size;
+};
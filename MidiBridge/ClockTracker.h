@@ -0,0 +1,286 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MidiMessage.h"
+#include "SysExBuffer.h"
+
+// Follows the MIDI clock (0xf8, 24 per quarter note) and the MIDI time code
+// of the inputs, so that the clients can get the tempo and the position
+// instead of the raw tick stream.
+//
+// The ticks carry the arrival time stamped in the driver callback. Their
+// jitter (USB polling, driver scheduling) is smoothed with a second order
+// delay-locked loop: the period and the phase of the next tick are
+// predicted and corrected by a fraction of the error at every tick.
+//
+// Runs on the sender thread; not thread safe.
+class ClockTracker
+{
+public:
+
+	// What the clients get from a clock source.
+	enum class Mode
+	{
+		Raw,    // The clock and time code messages only (no tracking).
+		Both,   // The messages and the tempo records.
+		Tempo   // The tempo records only: the messages are removed.
+	};
+
+	// Flags of an update.
+	static const uint8_t flagRunning = 0x01;  // Started (0xfa/0xfb) and not stopped (0xfc).
+	static const uint8_t flagLocked = 0x02;   // The tempo estimate has settled.
+	static const uint8_t flagTimecode = 0x04; // The time code is valid.
+
+	// Clock ticks between the periodic updates (one quarter note).
+	static const uint32_t ticksPerUpdate = 24;
+
+	// Ticks of a steady clock before the estimate is reported as locked.
+	static const uint32_t ticksToLock = 24;
+
+	// State of a clock source at a tick or a time code frame.
+	struct Update
+	{
+		uint8_t device;
+		uint8_t flags;
+
+		// Filtered time of the last tick (microseconds, Platform::GetTimestamp).
+		uint64_t tickTime;
+
+		// Tempo in thousandths of a BPM (0 = unknown).
+		uint32_t tempo;
+
+		// Song position of the last tick in clock ticks (24 per quarter note).
+		uint32_t position;
+
+		// Time code as in the full frame message: hours (with the rate in
+		// bits 5-6), minutes, seconds, frames.
+		uint8_t timecode[4];
+	};
+
+	ClockTracker()
+	{
+	}
+
+	// Check if an event is handled by the tracker.
+	static bool IsClockEvent(const MidiEvent& event)
+	{
+		if (event.sysex != nullptr) return IsFullFrame(event.sysex->data, event.sysex->length);
+		uint8_t status = event.message.bytes[0];
+		return status == 0xf8 || status == 0xf1 || status == 0xf2 || status == 0xfa || status == 0xfb || status == 0xfc;
+	}
+
+	// Check if an event is part of the raw tick stream (removed in the Tempo mode).
+	static bool IsTickEvent(const MidiEvent& event)
+	{
+		return event.sysex == nullptr && (event.message.bytes[0] == 0xf8 || event.message.bytes[0] == 0xf1);
+	}
+
+	// Feed an incoming event. Appends an update if the state of its source
+	// should be sent: periodically, on a transport change and on a new time
+	// code frame.
+	void Process(const MidiEvent& event, std::vector<Update>& updates)
+	{
+		if (!IsClockEvent(event)) return;
+
+		if (event.device >= sources.size()) sources.resize(event.device + 1);
+		Source& source = sources[event.device];
+
+		if (event.sysex != nullptr)
+		{
+			// Full frame: F0 7F <channel> 01 01 hh mm ss ff F7.
+			memcpy(source.timecode, event.sysex->data + 5, 4);
+			source.timecodeValid = true;
+			updates.push_back(GetUpdate(event.device, source));
+			return;
+		}
+
+		const MidiMessage& message = event.message;
+		switch (message.bytes[0])
+		{
+		case 0xf8:
+			if (ProcessTick(source, event.timestamp)) updates.push_back(GetUpdate(event.device, source));
+			break;
+
+		case 0xf1:
+			if (ProcessQuarterFrame(source, message.bytes[1])) updates.push_back(GetUpdate(event.device, source));
+			break;
+
+		case 0xf2:
+			// Song position pointer: sixteenth notes of 6 ticks.
+			source.nextPosition = (message.bytes[1] | (message.bytes[2] << 7)) * 6;
+			updates.push_back(GetUpdate(event.device, source));
+			break;
+
+		case 0xfa:
+			source.nextPosition = 0;
+			source.running = true;
+			updates.push_back(GetUpdate(event.device, source));
+			break;
+
+		case 0xfb:
+			source.running = true;
+			updates.push_back(GetUpdate(event.device, source));
+			break;
+
+		case 0xfc:
+			source.running = false;
+			updates.push_back(GetUpdate(event.device, source));
+			break;
+		}
+	}
+
+private:
+
+	// Loop gains for a bandwidth of 1% of the tick rate (about 0.5 Hz at
+	// 120 BPM): b = sqrt(2) * w, c = w * w with w = 2 * pi * 0.01.
+	static double GetPhaseGain()
+	{
+		return 0.0889;
+	}
+
+	static double GetPeriodGain()
+	{
+		return 0.00395;
+	}
+
+	struct Source
+	{
+		// Tick estimator (microseconds).
+		bool hasTick;
+		uint64_t lastTick;
+		double period;
+		double filteredTick;
+		double predictedTick;
+		uint32_t steadyTicks;
+		uint32_t ticksSinceUpdate;
+
+		// Transport.
+		bool running;
+		uint32_t position;
+		uint32_t nextPosition;
+
+		// Time code being assembled from the quarter frames.
+		uint8_t pieces[8];
+		uint8_t receivedPieces;
+		int lastPiece;
+		uint8_t timecode[4];
+		bool timecodeValid;
+
+		Source()
+			: hasTick(false), lastTick(0), period(0), filteredTick(0), predictedTick(0), steadyTicks(0), ticksSinceUpdate(0),
+			  running(false), position(0), nextPosition(0), receivedPieces(0), lastPiece(-1), timecodeValid(false)
+		{
+			memset(pieces, 0, sizeof(pieces));
+			memset(timecode, 0, sizeof(timecode));
+		}
+	};
+
+	std::vector<Source> sources;
+
+	static bool IsFullFrame(const uint8_t* data, size_t length)
+	{
+		return length == 10 && data[0] == 0xf0 && data[1] == 0x7f && data[3] == 0x01 && data[4] == 0x01 && data[9] == 0xf7;
+	}
+
+	// Returns true if the periodic update is due.
+	static bool ProcessTick(Source& source, uint64_t time)
+	{
+		if (source.running) source.position = source.nextPosition++;
+
+		if (!source.hasTick)
+		{
+			source.hasTick = true;
+			source.lastTick = time;
+			return false;
+		}
+
+		double interval = static_cast<double>(time - std::min(time, source.lastTick));
+		source.lastTick = time;
+
+		double error = static_cast<double>(time) - source.predictedTick;
+		if (source.period <= 0 || std::fabs(error) > source.period / 2)
+		{
+			// First interval, or a jump (clock restarted, tempo change too
+			// large for the loop): start over from the last interval.
+			bool wasLocked = source.steadyTicks >= ticksToLock;
+			source.period = interval;
+			source.filteredTick = static_cast<double>(time);
+			source.predictedTick = source.filteredTick + source.period;
+			source.steadyTicks = 0;
+			return wasLocked;
+		}
+
+		source.filteredTick = source.predictedTick + GetPhaseGain() * error;
+		source.period += GetPeriodGain() * error;
+		source.predictedTick = source.filteredTick + source.period;
+
+		// Report the lock as soon as it is reached, then once per beat.
+		bool locking = source.steadyTicks < ticksToLock && ++source.steadyTicks == ticksToLock;
+		if (locking || ++source.ticksSinceUpdate >= ticksPerUpdate)
+		{
+			source.ticksSinceUpdate = 0;
+			return true;
+		}
+		return false;
+	}
+
+	// Returns true when a time code frame is complete. Only forward
+	// playback (pieces 0 to 7 in order) is assembled.
+	static bool ProcessQuarterFrame(Source& source, uint8_t data)
+	{
+		// A malformed data byte (0x80 and above) must not index past the pieces.
+		int piece = (data >> 4) & 0x07;
+		source.pieces[piece] = data & 0x0f;
+
+		if (piece == 0) source.receivedPieces = 1;
+		else if (piece == source.lastPiece + 1) source.receivedPieces |= 1 << piece;
+		else source.receivedPieces = 0;
+		source.lastPiece = piece;
+
+		if (piece != 7 || source.receivedPieces != 0xff) return false;
+
+		const uint8_t* p = source.pieces;
+		int rate = (p[7] >> 1) & 0x03;
+		int frames = p[0] | (p[1] << 4);
+		int seconds = p[2] | (p[3] << 4);
+		int minutes = p[4] | (p[5] << 4);
+		int hours = p[6] | ((p[7] & 0x01) << 4);
+
+		// The frame was sent with piece 0; two frames have passed since.
+		static const int framesPerSecond[4] = { 24, 25, 30, 30 };
+		frames += 2;
+		if (frames >= framesPerSecond[rate])
+		{
+			frames -= framesPerSecond[rate];
+			if (++seconds == 60)
+			{
+				seconds = 0;
+				if (++minutes == 60)
+				{
+					minutes = 0;
+					hours = (hours + 1) % 24;
+				}
+			}
+		}
+
+		source.timecode[0] = static_cast<uint8_t>((rate << 5) | hours);
+		source.timecode[1] = static_cast<uint8_t>(minutes);
+		source.timecode[2] = static_cast<uint8_t>(seconds);
+		source.timecode[3] = static_cast<uint8_t>(frames);
+		source.timecodeValid = true;
+		return true;
+	}
+
+	static Update GetUpdate(uint8_t device, const Source& source)
+	{
+		Update update;
+		bool locked = source.period > 0 && source.steadyTicks >= ticksToLock;
+		update.device = device;
+		update.flags = (source.running ? flagRunning : 0) | (locked ? flagLocked : 0) | (source.timecodeValid ? flagTimecode : 0);
+		update.tickTime = static_cast<uint64_t>(source.filteredTick);
+		update.tempo = source.period > 0 ? static_cast<uint32_t>(60e9 / (24 * source.period)) : 0;
+		update.position = source.position;
+		memcpy(update.timecode, source.timecode, sizeof(update.timecode));
+		return update;
+	}
+};
@@ -0,0 +1,228 @@
+#pragma once
+
+#include "stdafx.h"
+#include "LocalEndpoint.h"
+
+// Local TCP endpoint taking commands for a running daemon.
+//
+// A connection sends one command line (e.g. "rescan") and receives the
+// reply before it is closed: "printf 'stats\n' | nc localhost 52366". It
+// listens on the loopback interface only. There is no thread: the daemon
+// loop waits on its sockets together with the wake handle of the control
+// events. The sockets are non-blocking, so a slow client only holds its
+// own connection.
+class ControlEndpoint
+{
+public:
+
+	// Executor of the commands (daemon loop thread).
+	class CommandDelegate
+	{
+	public:
+		virtual std::string ProcessControlCommand(const std::string& command) = 0;
+	};
+
+	static const int defaultPortNumber = 52366;
+
+	// Max length of a command line.
+	static const size_t maxCommandLength = 256;
+
+	// Max time for the client to send its command and read the reply (milliseconds).
+	static const int commandTimeout = 1000;
+
+	// Max number of the connections served at once. The others wait in the backlog.
+	static const size_t maxConnections = 8;
+
+	ControlEndpoint(CommandDelegate& cd)
+		: commandDelegate(cd), listenSocket(LocalEndpoint::invalidSocket)
+	{
+	}
+
+	~ControlEndpoint()
+	{
+		Stop();
+	}
+
+	// Start listening. Returns false if the port is not available.
+	bool Start(int port)
+	{
+		Stop();
+
+		listenSocket = LocalEndpoint::Listen(port);
+		if (listenSocket == LocalEndpoint::invalidSocket) return false;
+		LocalEndpoint::SetNonBlocking(listenSocket);
+		return true;
+	}
+
+	void Stop()
+	{
+		for (auto& connection : connections) LocalEndpoint::CloseSocket(connection.socket);
+		connections.clear();
+
+		if (listenSocket == LocalEndpoint::invalidSocket) return;
+		LocalEndpoint::CloseSocket(listenSocket);
+		listenSocket = LocalEndpoint::invalidSocket;
+	}
+
+	// Wait until the wake handle is readable or the timeout (milliseconds,
+	// -1 for no limit) passes, serving the connections in the meantime.
+	// Without the endpoint started, it's a plain wait on the wake handle.
+	void Poll(LocalEndpoint::socket_t wake, int timeout)
+	{
+		auto start = std::chrono::steady_clock::now();
+		while (true)
+		{
+			auto now = std::chrono::steady_clock::now();
+			int remaining = timeout;
+			if (timeout >= 0)
+			{
+				remaining = timeout - static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count());
+				if (remaining <= 0) return;
+			}
+
+			// Wake up for the nearest connection deadline too.
+			for (auto& connection : connections)
+			{
+				int untilDeadline = static_cast<int>(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(connection.deadline - now).count() + 1));
+				if (remaining < 0 || untilDeadline < remaining) remaining = untilDeadline;
+			}
+
+			entries.clear();
+			entries.push_back(GetEntry(wake, POLLIN));
+			for (auto& connection : connections) entries.push_back(GetEntry(connection.socket, connection.reply.empty() ? POLLIN : POLLOUT));
+			bool accepting = listenSocket != LocalEndpoint::invalidSocket && connections.size() < maxConnections;
+			if (accepting) entries.push_back(GetEntry(listenSocket, POLLIN));
+
+			LocalEndpoint::Poll(entries.data(), entries.size(), remaining);
+
+			now = std::chrono::steady_clock::now();
+			size_t kept = 0;
+			for (size_t i = 0; i < connections.size(); i++)
+			{
+				if (Serve(connections[i], entries[i + 1].revents, now))
+				{
+					if (kept != i) connections[kept] = std::move(connections[i]);
+					kept++;
+				}
+				else
+				{
+					LocalEndpoint::CloseSocket(connections[i].socket);
+				}
+			}
+			connections.resize(kept);
+
+			if (accepting && (entries.back().revents & POLLIN) != 0) Accept(now);
+
+			if ((entries[0].revents & POLLIN) != 0) return;
+		}
+	}
+
+private:
+
+	// Connection being served: the command line being received, then the
+	// reply being sent.
+	struct Connection
+	{
+		LocalEndpoint::socket_t socket;
+		std::string command;
+		std::string reply;
+		size_t sent;
+		std::chrono::steady_clock::time_point deadline;
+	};
+
+	CommandDelegate& commandDelegate;
+	LocalEndpoint::socket_t listenSocket;
+	std::vector<Connection> connections;
+	std::vector<pollfd> entries;
+
+	static pollfd GetEntry(LocalEndpoint::socket_t socket, short events)
+	{
+		pollfd entry;
+		entry.fd = socket;
+		entry.events = events;
+		entry.revents = 0;
+		return entry;
+	}
+
+	void Accept(std::chrono::steady_clock::time_point now)
+	{
+		while (connections.size() < maxConnections)
+		{
+			LocalEndpoint::socket_t socket = accept(listenSocket, nullptr, nullptr);
+			if (socket == LocalEndpoint::invalidSocket) break;
+			LocalEndpoint::SetNonBlocking(socket);
+
+			Connection connection;
+			connection.socket = socket;
+			connection.sent = 0;
+			connection.deadline = now + std::chrono::milliseconds(static_cast<int>(commandTimeout));
+			connections.push_back(connection);
+		}
+	}
+
+	// Go on with a connection. Returns false when it's done or dropped.
+	bool Serve(Connection& connection, short events, std::chrono::steady_clock::time_point now)
+	{
+		if (connection.reply.empty())
+		{
+			if (events == 0) return now < connection.deadline;
+
+			// Read what has arrived, up to the end of the line (or of the stream).
+			bool ended = false;
+			char buffer[64];
+			while (connection.command.size() < maxCommandLength && connection.command.find('\n') == std::string::npos)
+			{
+				int result = recv(connection.socket, buffer, sizeof(buffer), 0);
+				if (result > 0)
+				{
+					connection.command.append(buffer, result);
+				}
+				else if (result == 0)
+				{
+					ended = true;
+					break;
+				}
+				else
+				{
+					if (!LocalEndpoint::IsWouldBlock()) return false;
+					break;
+				}
+			}
+
+			if (!ended && connection.command.size() < maxCommandLength && connection.command.find('\n') == std::string::npos)
+			{
+				return now < connection.deadline;
+			}
+
+			std::string command = TrimLine(connection.command);
+			if (command.empty()) return false;
+			connection.reply = commandDelegate.ProcessControlCommand(command);
+			if (connection.reply.empty()) return false;
+		}
+
+		// Send what the socket takes now.
+		while (connection.sent < connection.reply.size())
+		{
+			int result = send(connection.socket, connection.reply.data() + connection.sent, static_cast<int>(connection.reply.size() - connection.sent), 0);
+			if (result > 0)
+			{
+				connection.sent += result;
+			}
+			else
+			{
+				if (result < 0 && LocalEndpoint::IsWouldBlock()) return now < connection.deadline;
+				return false;
+			}
+		}
+		return false;
+	}
+
+	// The first line without the surrounding blanks.
+	static std::string TrimLine(const std::string& text)
+	{
+		std::string line = text.substr(0, text.find('\n'));
+		size_t first = line.find_first_not_of(" \t\r");
+		size_t last = line.find_last_not_of(" \t\r");
+		return first == std::string::npos ? std::string() : line.substr(first, last - first + 1);
+	}
+};
@@ -7,8 +7,19 @@ class Debug
 {
 public:
 
-    // Assert function which displays a message on a failure.
-    static void Assert(bool condition, const char* format, ...)
+    // Called instead of the console prompt and the exit on a failure.
+    typedef void (*FailureHandler)();
+
+    // Set the failure handler (nullptr restores the prompt and the exit).
+    // The daemon uses it to shut down in order without a console.
+    static void SetFailureHandler(FailureHandler handler)
+    {
+        GetFailureHandler() = handler;
+    }
+
+    // Assert function which displays a message on a failure. Returns the
+    // condition when a failure handler lets the caller go on.
+    static bool Assert(bool condition, const char* format, ...)
     {
         if (!condition)
         {
@@ -21,8 +32,25 @@ public:
 
             puts("");
 
+            FailureHandler handler = GetFailureHandler();
+            if (handler != nullptr)
+            {
+                fflush(stdout);
+                handler();
+                return false;
+            }
+
             getchar();
             exit(EXIT_FAILURE);
         }
+        return true;
+    }
+
+private:
+
+    static FailureHandler& GetFailureHandler()
+    {
+        static FailureHandler handler = nullptr;
+        return handler;
     }
 };
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MidiBackend.h"
+
+// Table of the MIDI devices indexed by device ID, with the names cached at
+// enumeration and the handles of the opened inputs.
+//
+// It's modified under the owner's lock. The input callbacks look the handles
+// up in an immutable snapshot instead, so they never wait for the lock nor
+// call the driver.
+class DeviceRegistry
+{
+public:
+
+	struct Device
+	{
+		std::string name;
+		bool opened;
+
+		// Closed from the console: left alone by the rescans.
+		bool closedByUser;
+
+		// Input handle (the outputs are owned by the client's output set).
+		MidiBackend::Handle handle;
+
+		Device()
+			: opened(false), closedByUser(false), handle(0)
+		{
+		}
+	};
+
+	typedef std::vector<Device> DeviceList;
+
+	DeviceRegistry()
+		: inputHandles(std::make_shared<HandleMap>())
+	{
+	}
+
+	unsigned int GetInputCount() const
+	{
+		return static_cast<unsigned int>(inputs.size());
+	}
+
+	unsigned int GetOutputCount() const
+	{
+		return static_cast<unsigned int>(outputs.size());
+	}
+
+	const Device& GetInput(unsigned int id) const
+	{
+		return inputs[id];
+	}
+
+	const Device& GetOutput(unsigned int id) const
+	{
+		return outputs[id];
+	}
+
+	const DeviceList& GetInputs() const
+	{
+		return inputs;
+	}
+
+	const DeviceList& GetOutputs() const
+	{
+		return outputs;
+	}
+
+	bool IsInputOpened(unsigned int id) const
+	{
+		return id < inputs.size() && inputs[id].opened;
+	}
+
+	bool IsOutputOpened(unsigned int id) const
+	{
+		return id < outputs.size() && outputs[id].opened;
+	}
+
+	// Replace the cached enumeration. An entry whose name changed is reset;
+	// the caller must have closed it already.
+	void SetNames(const std::vector<std::string>& inNames, const std::vector<std::string>& outNames)
+	{
+		SetNames(inputs, inNames);
+		SetNames(outputs, outNames);
+	}
+
+	void SetInputOpened(unsigned int id, MidiBackend::Handle handle)
+	{
+		inputs[id].opened = true;
+		inputs[id].handle = handle;
+		PublishInputHandles();
+	}
+
+	void SetInputClosed(unsigned int id)
+	{
+		inputs[id].opened = false;
+		inputs[id].handle = 0;
+		PublishInputHandles();
+	}
+
+	void SetOutputOpened(unsigned int id, bool opened)
+	{
+		outputs[id].opened = opened;
+	}
+
+	void SetClosedByUser(bool output, unsigned int id, bool closed)
+	{
+		(output ? outputs : inputs)[id].closedByUser = closed;
+	}
+
+	void ClearClosedByUser()
+	{
+		for (auto& device : inputs) device.closedByUser = false;
+		for (auto& device : outputs) device.closedByUser = false;
+	}
+
+	// Find the ID of an opened input (any thread, lock-free).
+	bool FindInput(MidiBackend::Handle handle, unsigned int& id) const
+	{
+		auto snapshot = std::atomic_load(&inputHandles);
+		auto found = snapshot->find(handle);
+		if (found == snapshot->end()) return false;
+		id = found->second;
+		return true;
+	}
+
+private:
+
+	typedef std::unordered_map<MidiBackend::Handle, unsigned int> HandleMap;
+
+	DeviceList inputs;
+	DeviceList outputs;
+
+	// Handle -> ID of the opened inputs. Replaced as a whole.
+	std::shared_ptr<const HandleMap> inputHandles;
+
+	static void SetNames(DeviceList& devices, const std::vector<std::string>& names)
+	{
+		devices.resize(names.size());
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			if (devices[i].name != names[i])
+			{
+				devices[i] = Device();
+				devices[i].name = names[i];
+			}
+		}
+	}
+
+	void PublishInputHandles()
+	{
+		auto map = std::make_shared<HandleMap>();
+		for (unsigned int i = 0; i < inputs.size(); i++)
+		{
+			if (inputs[i].opened) (*map)[inputs[i].handle] = i;
+		}
+		std::shared_ptr<const HandleMap> snapshot = map;
+		std::atomic_store(&inputHandles, snapshot);
+	}
+};
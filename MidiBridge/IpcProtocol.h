@@ -0,0 +1,187 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MidiMessage.h"
+#include "SysExBuffer.h"
+#include "ClockTracker.h"
+
+// Wire protocol between the bridge and the clients.
+//
+// Version 1 is a sequence of 4-byte MidiMessage records. A record starting
+// with 0x00, which is never a MIDI status byte, is a control record:
+// { 0x00, command, arg0, arg1 }. Clients start with version 1 and can
+// switch to a newer one with the version control record.
+//
+// Version 2 sends the incoming MIDI messages in batch frames instead:
+//   header : { 0x00, 'B', count (LE16) } base timestamp (LE64, microseconds)
+//   records: { status, data1, data2, device, delta (LE16, microseconds from base) } * count
+// Data bytes are padded with 0xff as in version 1. Control records from
+// the server keep the 4-byte form.
+//
+// SysEx messages are sent in both directions as a control record with the
+// length followed by the data: { 0x00, 'X', length (LE16) } data[length].
+// The server only sends them to version 2 clients.
+//
+// A client can stamp a message with the time it should reach the devices,
+// on the server clock (microseconds, the clock of the batch frames):
+//   { 0x00, 'T', 0, 0 } time (LE64) message[4]
+// The clock record { 0x00, 'C', 0, 0 } asks for the current server time,
+// returned as { 0x00, 'C', 0, 0 } time (LE64).
+//
+// Version 2 clients can get the state of the clock sources (MIDI clock and
+// time code of an input) instead of or along with the raw ticks:
+//   { 0x00, 'K', device, flags } tick time (LE64) tempo (LE32, 1/1000 BPM)
+//   position (LE32, clock ticks) time code { hours | rate << 5, minutes, seconds, frames }
+// See ClockTracker for the flags and when the records are sent.
+struct IpcProtocol
+{
+	static const uint8_t controlPrefix = 0x00;
+
+	// Client -> server: { 0x00, 'V', requested version, 0 }
+	// Server -> client: { 0x00, 'V', accepted version, 0 }
+	static const uint8_t commandVersion = 'V';
+	static const uint8_t latestVersion = 2;
+
+	// Version 2 batch frame.
+	static const uint8_t commandBatch = 'B';
+	static const size_t batchHeaderSize = 12;
+	static const size_t batchRecordSize = 6;
+
+	// Length-prefixed SysEx message.
+	static const uint8_t commandSysEx = 'X';
+	static const size_t maxSysExLength = SysExPool::defaultBlockSize;
+
+	// Message scheduled at a time.
+	static const uint8_t commandTimed = 'T';
+	static const size_t timedRecordSize = 16;
+
+	// Server clock query and reply.
+	static const uint8_t commandClock = 'C';
+	static const size_t clockReplySize = 12;
+
+	// Clock source state (server -> version 2 clients).
+	static const uint8_t commandTempo = 'K';
+	static const size_t tempoRecordSize = 24;
+
+	// Client -> server: switch to the shared memory transport.
+	// Server -> client: { 0x00, 'S', id (LE16) }. The ID is 0xffff on failure.
+	// See SharedMemoryChannel for the object name and the layout.
+	static const uint8_t commandSharedMemory = 'S';
+	static const uint16_t invalidChannelId = 0xffff;
+
+	// Check if a record is a control record.
+	static bool IsControl(const uint8_t* record)
+	{
+		return record[0] == controlPrefix;
+	}
+
+	// Encode events in the version 1 format (appended to the buffer).
+	static void EncodeVersion1(const MidiEvent* events, int count, std::vector<uint8_t>& buffer)
+	{
+		// SysEx messages are skipped: version 1 clients can't parse them.
+		for (int i = 0; i < count; i++)
+		{
+			if (events[i].sysex != nullptr) continue;
+			buffer.insert(buffer.end(), events[i].message.bytes, events[i].message.bytes + sizeof(MidiMessage));
+		}
+	}
+
+	// Encode events in the version 2 format (appended to the buffer).
+	// A new frame starts whenever the delta doesn't fit in 16 bits.
+	static void EncodeVersion2(const MidiEvent* events, int count, std::vector<uint8_t>& buffer)
+	{
+		int i = 0;
+		while (i < count)
+		{
+			if (events[i].sysex != nullptr)
+			{
+				EncodeSysEx(events[i].sysex->data, events[i].sysex->length, buffer);
+				i++;
+				continue;
+			}
+
+			uint64_t base = events[i].timestamp;
+
+			// Find the range of the events which fit in this frame.
+			int end = i + 1;
+			while (end < count && end - i < 0xffff && events[end].sysex == nullptr &&
+				   events[end].timestamp >= base && events[end].timestamp - base <= 0xffff) end++;
+
+			int frameCount = end - i;
+			size_t offset = buffer.size();
+			buffer.resize(offset + batchHeaderSize + frameCount * batchRecordSize);
+			uint8_t* p = &buffer[offset];
+
+			p[0] = controlPrefix;
+			p[1] = commandBatch;
+			WriteLE16(p + 2, static_cast<uint16_t>(frameCount));
+			WriteLE64(p + 4, base);
+			p += batchHeaderSize;
+
+			for (; i < end; i++, p += batchRecordSize)
+			{
+				const MidiEvent& event = events[i];
+				p[0] = event.message.bytes[0];
+				p[1] = event.message.bytes[1];
+				p[2] = event.message.bytes[2];
+				p[3] = event.device;
+				WriteLE16(p + 4, static_cast<uint16_t>(event.timestamp - base));
+			}
+		}
+	}
+
+	// Encode a SysEx message (appended to the buffer).
+	static void EncodeSysEx(const uint8_t* data, size_t length, std::vector<uint8_t>& buffer)
+	{
+		uint8_t header[4] = { controlPrefix, commandSysEx };
+		WriteLE16(header + 2, static_cast<uint16_t>(length));
+		buffer.insert(buffer.end(), header, header + 4);
+		buffer.insert(buffer.end(), data, data + length);
+	}
+
+	// Encode a clock source state (appended to the buffer).
+	static void EncodeTempo(const ClockTracker::Update& update, std::vector<uint8_t>& buffer)
+	{
+		size_t offset = buffer.size();
+		buffer.resize(offset + tempoRecordSize);
+		uint8_t* p = &buffer[offset];
+
+		p[0] = controlPrefix;
+		p[1] = commandTempo;
+		p[2] = update.device;
+		p[3] = update.flags;
+		WriteLE64(p + 4, update.tickTime);
+		WriteLE32(p + 12, update.tempo);
+		WriteLE32(p + 16, update.position);
+		memcpy(p + 20, update.timecode, 4);
+	}
+
+	// Little endian readers/writers.
+	static uint16_t ReadLE16(const uint8_t* p)
+	{
+		return static_cast<uint16_t>(p[0] | (p[1] << 8));
+	}
+
+	static void WriteLE16(uint8_t* p, uint16_t value)
+	{
+		p[0] = static_cast<uint8_t>(value);
+		p[1] = static_cast<uint8_t>(value >> 8);
+	}
+
+	static void WriteLE32(uint8_t* p, uint32_t value)
+	{
+		for (int i = 0; i < 4; i++) p[i] = static_cast<uint8_t>(value >> (i * 8));
+	}
+
+	static uint64_t ReadLE64(const uint8_t* p)
+	{
+		uint64_t value = 0;
+		for (int i = 7; i >= 0; i--) value = (value << 8) | p[i];
+		return value;
+	}
+
+	static void WriteLE64(uint8_t* p, uint64_t value)
+	{
+		for (int i = 0; i < 8; i++) p[i] = static_cast<uint8_t>(value >> (i * 8));
+	}
+};
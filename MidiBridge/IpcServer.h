@@ -4,6 +4,11 @@
 #include "Debug.h"
 #include "MidiMessage.h"
 #include "Logger.h"
+#include "ByteRing.h"
+#include "IpcProtocol.h"
+#include "SharedMemoryChannel.h"
+#include "RoutingTable.h"
+#include "Metrics.h"
 
 // ICP server used to communicate with Unity.
 class IpcServer
@@ -21,19 +26,65 @@ public:
 	// Port number used for communication with the client.
 	static const int portNumber = 52364;
 
+	// How to treat a client which can't keep up with the outgoing traffic.
+	enum class SlowClientPolicy
+	{
+		DropMessages,   // Discard the messages which don't fit in its queue.
+		Disconnect      // Close the connection.
+	};
+
+	// Server settings.
+	struct Settings
+	{
+		// Max number of simultaneous clients.
+		int maxClients;
+
+		// Size of the per-client output queue in bytes.
+		size_t outputQueueSize;
+
+		SlowClientPolicy slowClientPolicy;
+
+		Settings()
+			: maxClients(8), outputQueueSize(64 * 1024), slowClientPolicy(SlowClientPolicy::DropMessages)
+		{
+		}
+	};
+
 	// Delegate class for handling incoming IPC messages.
     class MessageDelegate
     {
     public:
-        virtual int ProcessIncomingIpcMessageFromClient(const uint8_t* data, int offset, int length) = 0;
+        // The client is identified by its slot (see RoutingTable).
+        // A run of consecutive 4-byte messages is handed over in a single call.
+        virtual void ProcessIncomingIpcMessagesFromClient(int client, const uint8_t* data, int count) = 0;
+        virtual void ProcessIncomingSysExFromClient(int client, const uint8_t* data, int length) = 0;
+
+        // A message to send at a time on the Platform::GetTimestamp() clock.
+        virtual void ProcessTimedMessageFromClient(int client, uint64_t time, const uint8_t* data) = 0;
+
+        // A client has been accepted and is waiting for its snapshot (event loop thread).
+        virtual void ProcessNewIpcClient() = 0;
     };
 
     // Constructor.
-    IpcServer(MessageDelegate& md)
-        : messageDelegate(md)
+    IpcServer(MessageDelegate& md, const Settings& settings = Settings())
+        : messageDelegate(md), settings(settings)
     {
+        // The clients are addressed by their slot in the routing masks.
+        // The copy keeps the constant from being bound to a reference (no definition).
+        int routableClients = RoutingTable::maxClients;
+        this->settings.maxClients = std::min(settings.maxClients, routableClients);
         listenSocket = SOCKET_ERROR;
-        clientSocket = SOCKET_ERROR;
+        droppedBytes = 0;
+        sharedMemoryCount = 0;
+        snapshotPending = false;
+        stopReceiverThread = false;
+#ifdef WIN32
+        receiverThread = nullptr;
+#else
+        epollFd = -1;
+        wakeFd = -1;
+#endif
     }
 
     // Destructor. Blocks until the sender thread ends.
@@ -42,12 +93,13 @@ public:
 		StopAndWait();
 	}
 
-    // Sets up the listening socket.
-    void SetUp()
+    // Sets up the listening socket. Returns false on a failure let through
+    // by the Debug failure handler.
+    bool SetUp()
     {
         // Create a socket for listening.
         listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        Debug::Assert(listenSocket != SOCKET_ERROR, "Failed to create a socket for listening (%d)", errno);
+        if (!Debug::Assert(listenSocket != SOCKET_ERROR, "Failed to create a socket for listening (%d)", errno)) return false;
 
         // Make the socket reusable.
         int flag = 1;
@@ -61,29 +113,108 @@ public:
         addr.sin_port = htons(portNumber);
 
         int result = bind(listenSocket, (sockaddr *)&addr, sizeof(addr));
-        Debug::Assert(result != SOCKET_ERROR, "Failed on binding the listening socket (%d)", errno);
+        if (!Debug::Assert(result != SOCKET_ERROR, "Failed on binding the listening socket (%d)", errno)) return false;
 
         // Start listening.
         result = listen(listenSocket, SOMAXCONN);
-        Debug::Assert(result != SOCKET_ERROR, "Failed to start listening on the socket (%d)", errno);
+        if (!Debug::Assert(result != SOCKET_ERROR, "Failed to start listening on the socket (%d)", errno)) return false;
+
+        // The event loop never blocks on the listening socket.
+        SetNonBlocking(listenSocket);
+        return true;
     }
 
-	// Send a message to the client.
-	bool SendToClient(const MidiMessage message)
+	// Send a batch of MIDI events to the clients following the routing (sender thread).
+	void SendToClients(const MidiEvent* events, int count, const RoutingTable& routing)
 	{
-		int result = send(clientSocket, (char*)message.bytes, sizeof(message), 0);
-		return (result == sizeof(message));
+		EncodeBatch(events, count);
+		uint64_t common = GetCommonClients(events, count, routing);
+
+		std::lock_guard<std::mutex> guard(clientsMutex);
+		for (auto& client : clients)
+		{
+			if (!client->needsSnapshot) SendRouted(*client, events, count, routing, common);
+		}
 	}
 
-	// Start the receiver thread.
-	void Start()
+	// Send the clock source states to the version 2 clients following the
+	// routing of their input devices (sender thread).
+	void SendClockUpdates(const ClockTracker::Update* updates, int count, const RoutingTable& routing)
+	{
+		std::lock_guard<std::mutex> guard(clientsMutex);
+		for (auto& client : clients)
+		{
+			if (client->version < 2 || client->needsSnapshot) continue;
+
+			uint64_t bit = RoutingTable::GetBit(client->slot);
+			routedEncoded.clear();
+			for (int i = 0; i < count; i++)
+			{
+				if (routing.GetClients(updates[i].device) & bit) IpcProtocol::EncodeTempo(updates[i], routedEncoded);
+			}
+			if (!routedEncoded.empty()) SendToClient(*client, routedEncoded.data(), routedEncoded.size());
+		}
+	}
+
+	// Check if any client is waiting for its state snapshot (sender thread).
+	bool IsSnapshotPending() const
+	{
+		return snapshotPending.load(std::memory_order_acquire);
+	}
+
+	// Send the state snapshot to the clients waiting for it (sender thread).
+	// They get the live traffic only after this, so it must be called
+	// before SendToClients with the state as of the batch about to be sent.
+	void SendSnapshots(const MidiEvent* events, int count, const RoutingTable& routing)
+	{
+		snapshotPending.store(false, std::memory_order_release);
+
+		EncodeBatch(events, count);
+		uint64_t common = GetCommonClients(events, count, routing);
+
+		std::lock_guard<std::mutex> guard(clientsMutex);
+		for (auto& client : clients)
+		{
+			if (!client->needsSnapshot) continue;
+			client->needsSnapshot = false;
+			SendRouted(*client, events, count, routing, common);
+		}
+	}
+
+	// Number of the connected clients.
+	int GetClientCount()
+	{
+		std::lock_guard<std::mutex> guard(clientsMutex);
+		return static_cast<int>(clients.size());
+	}
+
+	// Total bytes discarded for slow clients.
+	uint64_t GetDroppedByteCount()
+	{
+		std::lock_guard<std::mutex> guard(clientsMutex);
+		return droppedBytes;
+	}
+
+	// Start the receiver thread. Returns false like SetUp.
+	bool Start()
 	{
 		stopReceiverThread = false;
 #ifdef WIN32
 		receiverThread = CreateThread(nullptr, 0, ReceiverThreadEntry, this, 0, nullptr);
-		Debug::Assert(receiverThread != nullptr, "Failed to start the IPC receiver thread.");
+		return Debug::Assert(receiverThread != nullptr, "Failed to start the IPC receiver thread.");
 #else
-#error unimplemented
+		// Set up the event loop: the listening socket and the wake-up event.
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (!Debug::Assert(epollFd >= 0, "Failed to create an epoll instance (%d)", errno)) return false;
+
+		wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (!Debug::Assert(wakeFd >= 0, "Failed to create an eventfd (%d)", errno)) return false;
+
+		bool watching = WatchSocket(wakeFd, false) && WatchSocket(listenSocket, false);
+		if (!Debug::Assert(watching, "Failed to register a descriptor to epoll (%d)", errno)) return false;
+
+		receiverThread = std::thread(&IpcServer::RunReceiverLoop, this);
+		return true;
 #endif
 	}
 
@@ -92,11 +223,32 @@ public:
 	{
 		stopReceiverThread = true;
 
-		if (clientSocket != SOCKET_ERROR)
+		// Wake up the event loop and let it finish by itself.
+#ifdef WIN32
+		if (receiverThread != nullptr)
+		{
+			WaitForSingleObject(receiverThread, INFINITE);
+			CloseHandle(receiverThread);
+			receiverThread = nullptr;
+		}
+#else
+		if (receiverThread.joinable())
+		{
+			uint64_t one = 1;
+			auto written = write(wakeFd, &one, sizeof(one));
+			(void)written;
+			receiverThread.join();
+		}
+#endif
+
+		// The sockets can be closed safely now.
+		std::vector<std::unique_ptr<Client>> closing;
 		{
-			closesocket(clientSocket);
-			clientSocket = SOCKET_ERROR;
+			std::lock_guard<std::mutex> guard(clientsMutex);
+			closing.swap(clients);
 		}
+		for (auto& client : closing) closesocket(client->socket);
+		closing.clear();
 
 		if (listenSocket != SOCKET_ERROR)
 		{
@@ -104,85 +256,660 @@ public:
 			listenSocket = SOCKET_ERROR;
 		}
 
-#ifdef WIN32
-		WaitForSingleObject(receiverThread, INFINITE);
-#else
-#error unimplemented
+#ifndef WIN32
+		if (wakeFd >= 0)
+		{
+			close(wakeFd);
+			wakeFd = -1;
+		}
+
+		if (epollFd >= 0)
+		{
+			close(epollFd);
+			epollFd = -1;
+		}
 #endif
 	}
 
 private:
 
+	// Size of the receive rings. Room for several frames of output from a
+	// client, and always more than a SysEx message with its header.
+	static const size_t receiveBufferSize = 8 * IpcProtocol::maxSysExLength;
+
+	// Connected client.
+	struct Client
+	{
+		socket_t socket;
+
+		// Data received from the client (event loop thread only).
+		ByteRing receiveRing;
+
+		// Slot number for the routing, unique among the connected clients.
+		int slot;
+
+		// Protocol version (guarded by clientsMutex).
+		uint8_t version;
+
+		// Live traffic is held until the state snapshot is sent (guarded by clientsMutex).
+		bool needsSnapshot;
+
+		// Data waiting to be sent to the client (guarded by clientsMutex).
+		ByteRing outputQueue;
+		bool waitingWritable;
+		bool closing;
+
+		// Shared memory transport and its reader thread, if negotiated.
+		std::unique_ptr<SharedMemoryChannel> sharedMemory;
+		std::thread sharedMemoryReader;
+		std::atomic<bool> stopSharedMemoryReader;
+		ByteRing sharedReceiveRing;
+
+		Client(socket_t socket, int slot, size_t outputQueueSize)
+			: socket(socket), receiveRing(receiveBufferSize), slot(slot), version(1), needsSnapshot(true), outputQueue(outputQueueSize), waitingWritable(false), closing(false),
+			  stopSharedMemoryReader(false), sharedReceiveRing(receiveBufferSize)
+		{
+		}
+
+		~Client()
+		{
+			if (sharedMemoryReader.joinable())
+			{
+				stopSharedMemoryReader = true;
+				sharedMemoryReader.join();
+			}
+		}
+	};
+
     // Delegate used for processing the incoming messages.
     MessageDelegate& messageDelegate;
 
-    // Sockets for listening and communication.
+	Settings settings;
+
+    // Socket for listening.
     socket_t listenSocket;
-    socket_t clientSocket;
+
+	// Connected clients and their output state.
+	std::vector<std::unique_ptr<Client>> clients;
+	std::mutex clientsMutex;
+	uint64_t droppedBytes;
+
+	// Serializes the delegate calls from the event loop and the shared memory readers.
+	std::mutex deliveryMutex;
+
+	// A frame wrapping around the end of a receive ring, copied out (under deliveryMutex).
+	uint8_t frameBuffer[4 + IpcProtocol::maxSysExLength];
+
+	// Set when a client is waiting for its snapshot.
+	std::atomic<bool> snapshotPending;
+
+	// Counter for naming the shared memory objects.
+	int sharedMemoryCount;
+
+	// Outgoing batch encoded for each protocol version (sender thread).
+	std::vector<uint8_t> encoded[IpcProtocol::latestVersion + 1];
+
+	// Part of a batch routed to a single client (sender thread).
+	std::vector<MidiEvent> routedEvents;
+	std::vector<uint8_t> routedEncoded;
 
 	// Stop flag for stopping the receiver thread.
-	bool stopReceiverThread;
+	std::atomic<bool> stopReceiverThread;
 
-	// Runs the receiver thread loop.
-	void RunReceiverLoop()
+	// Disable Nagle's algorithm: messages are latency sensitive and already batched.
+	static void SetNoDelay(socket_t socket)
 	{
-		while (!stopReceiverThread)
+		int flag = 1;
+		setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag));
+	}
+
+	// Platform dependant socket utilities.
+#ifdef WIN32
+
+	static void SetNonBlocking(socket_t socket)
+	{
+		u_long mode = 1;
+		ioctlsocket(socket, FIONBIO, &mode);
+	}
+
+	static int GetSocketError()
+	{
+		return WSAGetLastError();
+	}
+
+	static bool IsWouldBlock(int error)
+	{
+		return error == WSAEWOULDBLOCK;
+	}
+
+	static bool IsInterrupted(int error)
+	{
+		return error == WSAEINTR;
+	}
+
+	static int SendNoSignal(socket_t socket, const uint8_t* data, size_t length)
+	{
+		return send(socket, reinterpret_cast<const char*>(data), static_cast<int>(length), 0);
+	}
+
+#else
+
+	static int closesocket(socket_t socket)
+	{
+		return close(socket);
+	}
+
+	static void SetNonBlocking(socket_t socket)
+	{
+		int flags = fcntl(socket, F_GETFL, 0);
+		fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	static int GetSocketError()
+	{
+		return errno;
+	}
+
+	static bool IsWouldBlock(int error)
+	{
+		return error == EAGAIN || error == EWOULDBLOCK;
+	}
+
+	static bool IsInterrupted(int error)
+	{
+		return error == EINTR;
+	}
+
+	static int SendNoSignal(socket_t socket, const uint8_t* data, size_t length)
+	{
+		return static_cast<int>(send(socket, data, length, MSG_NOSIGNAL));
+	}
+
+#endif
+
+	// Encode a batch once per protocol version (sender thread).
+	void EncodeBatch(const MidiEvent* events, int count)
+	{
+		encoded[1].clear();
+		encoded[2].clear();
+		IpcProtocol::EncodeVersion1(events, count, encoded[1]);
+		IpcProtocol::EncodeVersion2(events, count, encoded[2]);
+	}
+
+	// Client slots which get the whole batch.
+	static uint64_t GetCommonClients(const MidiEvent* events, int count, const RoutingTable& routing)
+	{
+		uint64_t common = RoutingTable::all;
+		for (int i = 0; i < count; i++) common &= routing.GetClients(events[i].device);
+		return common;
+	}
+
+	// Send the encoded batch to a client, or only the part routed to it.
+	// Must be called with clientsMutex locked (sender thread).
+	void SendRouted(Client& client, const MidiEvent* events, int count, const RoutingTable& routing, uint64_t common)
+	{
+		uint64_t bit = RoutingTable::GetBit(client.slot);
+		if (common & bit)
+		{
+			// The common case: the buffer shared by every client.
+			const std::vector<uint8_t>& data = encoded[client.version];
+			if (!data.empty()) SendToClient(client, data.data(), data.size());
+			return;
+		}
+
+		routedEvents.clear();
+		for (int i = 0; i < count; i++)
+		{
+			if (routing.GetClients(events[i].device) & bit) routedEvents.push_back(events[i]);
+		}
+		if (routedEvents.empty()) return;
+
+		routedEncoded.clear();
+		if (client.version >= 2)
+		{
+			IpcProtocol::EncodeVersion2(routedEvents.data(), static_cast<int>(routedEvents.size()), routedEncoded);
+		}
+		else
 		{
-			Logger::RecordMisc("Waiting for a connection.");
+			IpcProtocol::EncodeVersion1(routedEvents.data(), static_cast<int>(routedEvents.size()), routedEncoded);
+		}
+		if (!routedEncoded.empty()) SendToClient(client, routedEncoded.data(), routedEncoded.size());
+	}
 
-			// Accept a new connection.
-			clientSocket = accept(listenSocket, NULL, NULL);
-			if (stopReceiverThread) break;
-			Debug::Assert(clientSocket != SOCKET_ERROR, "Failed on accepting the socket (%d)", errno);
-			
-			Logger::RecordMisc("Accepted a new connection.");
+	// Send data to a client through its transport.
+	// Must be called with clientsMutex locked.
+	void SendToClient(Client& client, const uint8_t* data, size_t length)
+	{
+		if (client.closing) return;
+		Metrics::Get().bytesToClients.Add(length);
 
-			u_char buffer[2048];
-			int filled = 0;
+		if (client.sharedMemory)
+		{
+			if (!client.sharedMemory->Write(data, length)) HandleSlowClient(client, length);
+		}
+		else
+		{
+			SendOrQueue(client, data, length);
+		}
+	}
 
-			while (!stopReceiverThread)
+	// Send data to a client directly, or queue it if the socket is busy.
+	// Must be called with clientsMutex locked.
+	void SendOrQueue(Client& client, const uint8_t* data, size_t length)
+	{
+		if (client.outputQueue.IsEmpty())
+		{
+			// Try to send it immediately.
+			while (length > 0)
 			{
-				// Receive data from the connection.
-				int length = recv(clientSocket, (char *)buffer + filled, sizeof(buffer)-filled, 0);
-
-				if (length == 0)
+				int result = SendNoSignal(client.socket, data, length);
+				if (result > 0)
 				{
-					Logger::RecordMisc("IPC: The connection seems to be lost.");
-					break;
+					data += result;
+					length -= result;
+					continue;
 				}
-				else if (length < 0)
+
+				int error = GetSocketError();
+				if (result < 0 && IsInterrupted(error)) continue;
+				if (result < 0 && IsWouldBlock(error)) break;
+
+				// The connection is broken: let the event loop close it.
+				DisconnectClient(client);
+				return;
+			}
+
+			if (length == 0) return;
+
+			// Keep the rest of the data for the client. It's always smaller than
+			// the queue as long as the queue is larger than a batch.
+			if (!client.outputQueue.Write(data, length))
+			{
+				HandleSlowClient(client, length);
+				return;
+			}
+		}
+		else if (!client.outputQueue.Write(data, length))
+		{
+			HandleSlowClient(client, length);
+			return;
+		}
+
+		FlushOutputQueue(client);
+	}
+
+	// Send the queued data to a client as much as possible.
+	// Must be called with clientsMutex locked.
+	void FlushOutputQueue(Client& client)
+	{
+		while (!client.outputQueue.IsEmpty())
+		{
+			size_t length;
+			const uint8_t* data = client.outputQueue.GetReadPointer(length);
+			int result = SendNoSignal(client.socket, data, length);
+
+			if (result > 0)
+			{
+				client.outputQueue.Consume(result);
+				continue;
+			}
+
+			int error = GetSocketError();
+			if (result < 0 && IsInterrupted(error)) continue;
+			if (result < 0 && IsWouldBlock(error)) break;
+
+			DisconnectClient(client);
+			return;
+		}
+
+		// Ask the event loop for a writable notification while data remains.
+		SetWaitingWritable(client, !client.outputQueue.IsEmpty());
+	}
+
+	// Apply the slow client policy to a client with a full queue.
+	void HandleSlowClient(Client& client, size_t length)
+	{
+		droppedBytes += length;
+		if (settings.slowClientPolicy == SlowClientPolicy::Disconnect)
+		{
+			Logger::RecordMisc("IPC: Disconnecting a slow client.");
+			DisconnectClient(client);
+		}
+	}
+
+	// Shut down a client connection. The event loop closes it afterwards.
+	void DisconnectClient(Client& client)
+	{
+		if (client.closing) return;
+		client.closing = true;
+		client.outputQueue.Clear();
+#ifdef WIN32
+		shutdown(client.socket, SD_BOTH);
+#else
+		shutdown(client.socket, SHUT_RDWR);
+#endif
+	}
+
+	// Accept pending connections (event loop thread).
+	void AcceptConnections()
+	{
+		while (true)
+		{
+			socket_t socket = accept(listenSocket, NULL, NULL);
+			if (socket == SOCKET_ERROR)
+			{
+				int error = GetSocketError();
+				if (!IsWouldBlock(error) && !IsInterrupted(error))
 				{
-					Logger::RecordMisc("recv failed (%d)\n", errno);
-					break;
+					Logger::RecordMisc("accept failed (%d)", error);
 				}
+				return;
+			}
+
+			std::lock_guard<std::mutex> guard(clientsMutex);
+
+			if (static_cast<int>(clients.size()) >= settings.maxClients)
+			{
+				Logger::RecordMisc("IPC: Too many clients; refused a connection.");
+				closesocket(socket);
+				continue;
+			}
+
+			SetNonBlocking(socket);
+			SetNoDelay(socket);
+
+			// A connection the event loop can't watch would never be served.
+			if (!WatchSocket(socket, false))
+			{
+				Logger::RecordMisc("IPC: Failed to watch a connection (%d); refused it.", GetSocketError());
+				closesocket(socket);
+				continue;
+			}
+
+			clients.emplace_back(new Client(socket, GetFreeSlot(), settings.outputQueueSize));
+
+			Logger::RecordMisc("Accepted a new connection (slot %d, %d clients).", clients.back()->slot, static_cast<int>(clients.size()));
+
+			// Let the sender bring the client up to date.
+			snapshotPending.store(true, std::memory_order_release);
+			messageDelegate.ProcessNewIpcClient();
+		}
+	}
+
+	// Lowest slot not used by the connected clients.
+	// Must be called with clientsMutex locked.
+	int GetFreeSlot()
+	{
+		for (int slot = 0;; slot++)
+		{
+			bool used = false;
+			for (auto& client : clients) used = used || client->slot == slot;
+			if (!used) return slot;
+		}
+	}
+
+	// Find a client by its socket.
+	Client* FindClient(socket_t socket)
+	{
+		std::lock_guard<std::mutex> guard(clientsMutex);
+		for (auto& client : clients)
+		{
+			if (client->socket == socket) return client.get();
+		}
+		return nullptr;
+	}
+
+	// Drain the data available on a client socket (event loop thread).
+	// Returns false if the connection should be closed.
+	bool ReceiveFromClient(Client& client)
+	{
+		while (true)
+		{
+			// Frames never fill the ring, so there is always some space after processing.
+			size_t space;
+			uint8_t* destination = client.receiveRing.GetWritePointer(space);
+			int length = recv(client.socket, (char *)destination, static_cast<int>(space), 0);
+
+			if (length == 0)
+			{
+				Logger::RecordMisc("IPC: The connection seems to be lost.");
+				return false;
+			}
+			else if (length < 0)
+			{
+				int error = GetSocketError();
+				if (IsWouldBlock(error)) return true;
+				if (IsInterrupted(error)) continue;
+				Logger::RecordMisc("recv failed (%d)", error);
+				return false;
+			}
+
+			Metrics::Get().receiveCalls.Add();
+			Metrics::Get().receiveSize.Record(length);
+
+			client.receiveRing.Commit(length);
+
+			// Process the messages with the delegate.
+			if (!ProcessReceivedData(client, client.receiveRing)) return false;
+		}
+	}
+
+	// Process the data in a receive ring with the delegate.
+	// Returns false on a protocol error.
+	//
+	// The frames are handled in place. Only a frame wrapping around the end
+	// of the ring is copied out, into the frame buffer.
+	bool ProcessReceivedData(Client& client, ByteRing& ring)
+	{
+		// The messages from the all clients and transports are merged here.
+		std::lock_guard<std::mutex> guard(deliveryMutex);
+
+		while (ring.GetSize() >= 4)
+		{
+			size_t contiguous;
+			const uint8_t* data = ring.GetReadPointer(contiguous);
 
-				filled += length;
+			uint8_t header[4];
+			ring.Peek(header, sizeof(header));
 
-				// Process the messages with the delegate.
-				int offset = 0;
-				while (offset + 4 <= filled)
+			if (!IpcProtocol::IsControl(header))
+			{
+				if (contiguous >= 4)
+				{
+					// The run of messages up to the next control record or the end of the region.
+					size_t count = 1;
+					while ((count + 1) * 4 <= contiguous && !IpcProtocol::IsControl(data + count * 4)) count++;
+					messageDelegate.ProcessIncomingIpcMessagesFromClient(client.slot, data, static_cast<int>(count));
+					ring.Consume(count * 4);
+				}
+				else
 				{
-					offset = messageDelegate.ProcessIncomingIpcMessageFromClient(buffer, offset, filled);
+					messageDelegate.ProcessIncomingIpcMessagesFromClient(client.slot, header, 1);
+					ring.Consume(4);
 				}
+				continue;
+			}
 
-				// Clear the data processed with the delegate.
-				if (offset == filled)
+			// Size of the control frame.
+			size_t frameSize = 4;
+			if (header[1] == IpcProtocol::commandSysEx)
+			{
+				int length = IpcProtocol::ReadLE16(header + 2);
+				if (length > static_cast<int>(IpcProtocol::maxSysExLength))
 				{
-					filled = 0;
+					Logger::RecordMisc("IPC: Too long SysEx message (%d bytes).", length);
+					return false;
 				}
-				else
+				frameSize += length;
+			}
+			else if (header[1] == IpcProtocol::commandTimed)
+			{
+				frameSize = IpcProtocol::timedRecordSize;
+			}
+
+			// Wait for the rest of the frame.
+			if (frameSize > ring.GetSize()) break;
+
+			const uint8_t* frame = data;
+			if (frameSize > contiguous)
+			{
+				ring.Peek(frameBuffer, frameSize);
+				frame = frameBuffer;
+			}
+
+			if (header[1] == IpcProtocol::commandSysEx)
+			{
+				// Handed over in place; the delegate doesn't keep the pointer.
+				messageDelegate.ProcessIncomingSysExFromClient(client.slot, frame + 4, static_cast<int>(frameSize - 4));
+			}
+			else if (header[1] == IpcProtocol::commandTimed)
+			{
+				messageDelegate.ProcessTimedMessageFromClient(client.slot, IpcProtocol::ReadLE64(frame + 4), frame + 12);
+			}
+			else
+			{
+				ProcessControlRecord(client, frame);
+			}
+
+			ring.Consume(frameSize);
+		}
+		return true;
+	}
+
+	// Handle a control record from a client.
+	void ProcessControlRecord(Client& client, const uint8_t* record)
+	{
+		if (record[1] == IpcProtocol::commandVersion)
+		{
+			uint8_t latestVersion = IpcProtocol::latestVersion;
+			uint8_t version = std::max<uint8_t>(1, std::min(record[2], latestVersion));
+			uint8_t reply[4] = { IpcProtocol::controlPrefix, IpcProtocol::commandVersion, version, 0 };
+
+			// The reply is the last record in the old version.
+			std::lock_guard<std::mutex> guard(clientsMutex);
+			SendToClient(client, reply, sizeof(reply));
+			client.version = version;
+		}
+		else if (record[1] == IpcProtocol::commandClock)
+		{
+			uint8_t reply[IpcProtocol::clockReplySize] = { IpcProtocol::controlPrefix, IpcProtocol::commandClock, 0, 0 };
+			IpcProtocol::WriteLE64(reply + 4, Platform::GetTimestamp());
+
+			std::lock_guard<std::mutex> guard(clientsMutex);
+			SendToClient(client, reply, sizeof(reply));
+		}
+		else if (record[1] == IpcProtocol::commandSharedMemory)
+		{
+			uint16_t id = StartSharedMemory(client);
+			uint8_t reply[4] = { IpcProtocol::controlPrefix, IpcProtocol::commandSharedMemory, static_cast<uint8_t>(id), static_cast<uint8_t>(id >> 8) };
+
+			// The reply goes through TCP. The client switches over after receiving it.
+			std::lock_guard<std::mutex> guard(clientsMutex);
+			if (!client.closing) SendOrQueue(client, reply, sizeof(reply));
+		}
+	}
+
+	// Set up the shared memory transport for a client. Returns the channel ID.
+	uint16_t StartSharedMemory(Client& client)
+	{
+		if (client.sharedMemory) return IpcProtocol::invalidChannelId;
+
+		uint16_t id = static_cast<uint16_t>(sharedMemoryCount++ % IpcProtocol::invalidChannelId);
+		std::unique_ptr<SharedMemoryChannel> channel(new SharedMemoryChannel());
+
+		if (!channel->Create(SharedMemoryChannel::GetName(portNumber, id)))
+		{
+			Logger::RecordMisc("IPC: Failed to create a shared memory channel.");
+			return IpcProtocol::invalidChannelId;
+		}
+
+		client.stopSharedMemoryReader = false;
+		client.sharedMemoryReader = std::thread(&IpcServer::RunSharedMemoryReader, this, &client, channel.get());
+
+		// From now on the outgoing traffic goes through the shared memory.
+		{
+			std::lock_guard<std::mutex> guard(clientsMutex);
+			client.sharedMemory = std::move(channel);
+		}
+
+		Logger::RecordMisc("IPC: A client switched to shared memory (channel %d).", id);
+		return id;
+	}
+
+	// Reader thread for the client -> server shared memory ring.
+	void RunSharedMemoryReader(Client* client, SharedMemoryChannel* channel)
+	{
+		while (!client->stopSharedMemoryReader)
+		{
+			size_t space;
+			uint8_t* destination = client->sharedReceiveRing.GetWritePointer(space);
+			size_t length = channel->Read(destination, space);
+
+			if (length == 0)
+			{
+				channel->WaitForData(50);
+				continue;
+			}
+
+			Metrics::Get().receiveCalls.Add();
+			Metrics::Get().receiveSize.Record(length);
+
+			client->sharedReceiveRing.Commit(length);
+			if (!ProcessReceivedData(*client, client->sharedReceiveRing))
+			{
+				// Let the event loop close the connection.
+				std::lock_guard<std::mutex> guard(clientsMutex);
+				DisconnectClient(*client);
+				return;
+			}
+		}
+	}
+
+	// Remove a client and close the connection (event loop thread).
+	void CloseClient(socket_t socket)
+	{
+		UnwatchSocket(socket);
+
+		std::unique_ptr<Client> removed;
+		int remaining;
+		{
+			std::lock_guard<std::mutex> guard(clientsMutex);
+			for (auto itr = clients.begin(); itr != clients.end(); ++itr)
+			{
+				if ((*itr)->socket == socket)
 				{
-					memcpy(buffer, buffer + offset, filled - offset);
-					filled = filled - offset;
+					removed = std::move(*itr);
+					clients.erase(itr);
+					break;
 				}
 			}
+			remaining = static_cast<int>(clients.size());
+		}
 
-			Logger::RecordMisc("Closing the connection.");
+		// Stops the shared memory reader if any.
+		removed.reset();
+		closesocket(socket);
 
-			// Close the connection anyway.
-			closesocket(clientSocket);
-			clientSocket = SOCKET_ERROR;
+		Logger::RecordMisc("Closed a connection (%d clients).", remaining);
+	}
+
+	// Handle the events on a client socket (event loop thread).
+	void ProcessClientEvent(socket_t socket, bool readable, bool writable)
+	{
+		Client* client = FindClient(socket);
+		if (client == nullptr) return;
+
+		bool alive = true;
+
+		if (readable) alive = ReceiveFromClient(*client);
+
+		if (alive && writable)
+		{
+			std::lock_guard<std::mutex> guard(clientsMutex);
+			FlushOutputQueue(*client);
 		}
+
+		if (!alive) CloseClient(socket);
 	}
 
 #ifdef WIN32
@@ -198,5 +925,135 @@ private:
 		return 0;
 	}
 
+	// Event registration is implicit with WSAPoll.
+	bool WatchSocket(socket_t socket, bool writable)
+	{
+		return true;
+	}
+
+	void UnwatchSocket(socket_t socket)
+	{
+	}
+
+	void SetWaitingWritable(Client& client, bool waiting)
+	{
+		client.waitingWritable = waiting;
+	}
+
+	// Runs the receiver thread loop.
+	void RunReceiverLoop()
+	{
+		std::vector<WSAPOLLFD> pollFds;
+
+		Logger::RecordMisc("Waiting for connections.");
+
+		while (!stopReceiverThread)
+		{
+			// Collect the sockets to be watched.
+			pollFds.clear();
+			WSAPOLLFD listenFd = { listenSocket, POLLRDNORM, 0 };
+			pollFds.push_back(listenFd);
+			{
+				std::lock_guard<std::mutex> guard(clientsMutex);
+				for (auto& client : clients)
+				{
+					WSAPOLLFD clientFd = { client->socket, static_cast<SHORT>(POLLRDNORM | (client->waitingWritable ? POLLWRNORM : 0)), 0 };
+					pollFds.push_back(clientFd);
+				}
+			}
+
+			// There is no wake-up event with WSAPoll: time out to check the stop flag
+			// and to pick up new write interests.
+			int count = WSAPoll(pollFds.data(), static_cast<ULONG>(pollFds.size()), 10);
+			if (count <= 0) continue;
+
+			if (pollFds[0].revents & POLLRDNORM) AcceptConnections();
+
+			for (size_t i = 1; i < pollFds.size(); i++)
+			{
+				auto revents = pollFds[i].revents;
+				if (revents == 0) continue;
+				bool readable = (revents & (POLLRDNORM | POLLHUP | POLLERR)) != 0;
+				bool writable = (revents & POLLWRNORM) != 0;
+				ProcessClientEvent(pollFds[i].fd, readable, writable);
+			}
+		}
+	}
+
+#else
+
+	// Receiver thread and the event loop resources.
+	std::thread receiverThread;
+	int epollFd;
+	int wakeFd;
+
+	// Add/remove a file descriptor to/from the event loop.
+	// Returns false (with errno set) if it can't be watched.
+	bool WatchSocket(int fd, bool writable)
+	{
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | (writable ? static_cast<uint32_t>(EPOLLOUT) : 0U);
+		event.data.fd = fd;
+		return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+	}
+
+	void UnwatchSocket(int fd)
+	{
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+	}
+
+	// Enable/disable the writable notification for a client.
+	void SetWaitingWritable(Client& client, bool waiting)
+	{
+		if (client.waitingWritable == waiting) return;
+		client.waitingWritable = waiting;
+
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | (waiting ? static_cast<uint32_t>(EPOLLOUT) : 0U);
+		event.data.fd = client.socket;
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, client.socket, &event);
+	}
+
+	// Runs the receiver thread loop.
+	void RunReceiverLoop()
+	{
+		Logger::RecordMisc("Waiting for connections.");
+
+		while (!stopReceiverThread)
+		{
+			epoll_event events[16];
+			int count = epoll_wait(epollFd, events, 16, -1);
+
+			if (count < 0)
+			{
+				if (errno == EINTR) continue;
+				Logger::RecordMisc("epoll_wait failed (%d)", errno);
+				break;
+			}
+
+			for (int i = 0; i < count && !stopReceiverThread; i++)
+			{
+				int fd = events[i].data.fd;
+				if (fd == wakeFd)
+				{
+					// Stop request from StopAndWait.
+					break;
+				}
+				else if (fd == listenSocket)
+				{
+					AcceptConnections();
+				}
+				else
+				{
+					bool readable = (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+					bool writable = (events[i].events & EPOLLOUT) != 0;
+					ProcessClientEvent(fd, readable, writable);
+				}
+			}
+		}
+	}
+
 #endif
 };
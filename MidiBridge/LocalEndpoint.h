@@ -0,0 +1,104 @@
+#pragma once
+
+#include "stdafx.h"
+
+// Socket utilities of the local TCP endpoints (metrics, control): they
+// listen on the loopback interface only and exchange short texts.
+class LocalEndpoint
+{
+public:
+
+#ifdef WIN32
+	typedef SOCKET socket_t;
+	static const socket_t invalidSocket = INVALID_SOCKET;
+#else
+	typedef int socket_t;
+	static const socket_t invalidSocket = -1;
+#endif
+
+	// Open a socket listening on the loopback interface.
+	// Returns invalidSocket if the port is not available.
+	static socket_t Listen(int port)
+	{
+		socket_t listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listenSocket == invalidSocket) return invalidSocket;
+
+		int flag = 1;
+		setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof(flag));
+
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(static_cast<u_short>(port));
+
+		if (bind(listenSocket, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenSocket, 8) != 0)
+		{
+			CloseSocket(listenSocket);
+			return invalidSocket;
+		}
+		return listenSocket;
+	}
+
+	static void CloseSocket(socket_t socket)
+	{
+#ifdef WIN32
+		closesocket(socket);
+#else
+		close(socket);
+#endif
+	}
+
+	static void SetNonBlocking(socket_t socket)
+	{
+#ifdef WIN32
+		u_long mode = 1;
+		ioctlsocket(socket, FIONBIO, &mode);
+#else
+		fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+	}
+
+	// Check if the last call failed only because a non-blocking socket wasn't ready.
+	static bool IsWouldBlock()
+	{
+#ifdef WIN32
+		return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+	}
+
+	// Wait up to the timeout (milliseconds, -1 for no limit) for the events of the entries.
+	static int Poll(pollfd* entries, size_t count, int timeout)
+	{
+#ifdef WIN32
+		return WSAPoll(entries, static_cast<ULONG>(count), timeout);
+#else
+		return poll(entries, static_cast<nfds_t>(count), timeout);
+#endif
+	}
+
+	// Wait up to the timeout (milliseconds) for the socket to be readable.
+	static bool WaitForInput(socket_t socket, int timeout)
+	{
+		pollfd entry;
+		entry.fd = socket;
+		entry.events = POLLIN;
+		entry.revents = 0;
+		return Poll(&entry, 1, timeout) > 0;
+	}
+
+	// Send the whole text (a blocking socket). Returns false if the peer went away.
+	static bool SendAll(socket_t socket, const std::string& text)
+	{
+		size_t offset = 0;
+		while (offset < text.size())
+		{
+			int result = send(socket, text.data() + offset, static_cast<int>(text.size() - offset), 0);
+			if (result <= 0) return false;
+			offset += result;
+		}
+		return true;
+	}
+};
@@ -3,12 +3,53 @@
 #include "stdafx.h"
 #include "Debug.h"
 #include "MidiMessage.h"
+#include "MessageQueue.h"
+#include "Platform.h"
 
 // Log taking and view class.
+// The records are queued as fixed-size binary records and formatted by a
+// background thread, so recording never blocks on the console or the disk.
 class Logger
 {
 public:
 
+	// Size of the record queue.
+	static const size_t queueSize = 8192;
+
+	// Start/stop the writer thread. Stop() flushes the pending records.
+	static void Start()
+	{
+		Logger& state = GetState();
+		if (state.running) return;
+		state.stopWriterThread = false;
+		state.writerThread = std::thread(&Logger::RunWriterLoop, &state);
+		state.running = true;
+	}
+
+	static void Stop()
+	{
+		GetState().StopWriter();
+	}
+
+	// Write the MIDI records to a binary file instead of the console.
+	// Must be called before Start().
+	//
+	// File layout: "MBLG" and a LE32 version (1), followed by 16-byte records:
+	// timestamp in microseconds (LE64), direction (0 = in, 1 = out), the four
+	// message bytes and three reserved bytes.
+	static bool OpenFile(const _TCHAR* path)
+	{
+		Logger& state = GetState();
+		Debug::Assert(!state.running, "The log file must be opened before starting the logger.");
+
+		state.file = _tfopen(path, _T("wb"));
+		if (state.file == nullptr) return false;
+
+		uint8_t header[8] = { 'M', 'B', 'L', 'G', fileVersion, 0, 0, 0 };
+		fwrite(header, 1, sizeof(header), state.file);
+		return true;
+	}
+
 	// Enable/disable the logger.
 	static void Enable()
 	{
@@ -23,70 +64,106 @@ public:
 	static void RecordMisc(const char* format, ...)
 	{
 		Logger& state = GetState();
-		if (state.enabled)
+		if (state.enabled && state.running)
 		{
-			if (state.rowCount >= 0) PrintSeparator(true);
+			char text[512];
 			va_list args;
 			va_start(args, format);
-			vprintf(format, args);
+			vsnprintf(text, sizeof(text), format, args);
 			va_end(args);
-			puts("");
-			state.rowCount = -1;
+			PushText(text);
 		}
 	}
 	static void RecordMisc(const wchar_t* format, ...)
 	{
 		Logger& state = GetState();
-		if (state.enabled)
+		if (state.enabled && state.running)
 		{
-			if (state.rowCount >= 0) PrintSeparator(true);
+			wchar_t wideText[512];
 			va_list args;
 			va_start(args, format);
-			vwprintf(format, args);
+			vswprintf(wideText, sizeof(wideText) / sizeof(wchar_t), format, args);
 			va_end(args);
-			puts("");
-			state.rowCount = -1;
+
+			char text[512 * 4];
+			size_t length = wcstombs(text, wideText, sizeof(text) - 1);
+			text[length == static_cast<size_t>(-1) ? 0 : length] = 0;
+			PushText(text);
 		}
 	}
 
 	// MIDI message record.
-	static void RecordMidiInput(MidiMessage& message)
+	static void RecordMidiInput(const MidiMessage& message)
 	{
-		if (!GetState().enabled) return;
-		PrintMidiHeaderWithInterval();
-		PrintMidiMessage(message, "IN");
+		PushMessage(message, RecordKind::MidiInput);
 	}
-	static void RecordMidiOutput(MidiMessage& message)
+	static void RecordMidiOutput(const MidiMessage& message)
 	{
-		if (!GetState().enabled) return;
-		PrintMidiHeaderWithInterval();
-		PrintMidiMessage(message, "OUT");
+		PushMessage(message, RecordKind::MidiOutput);
 	}
 
-	// Print a separator.
-	static void PrintSeparator(bool column = false)
+	// Number of the records discarded because the queue was full.
+	static uint64_t GetDroppedCount()
 	{
-		if (GetState().enabled)
-		{
-			if (column)
-			{
-				puts("-----+----------+----+-----------");
-			}
-			else
-			{
-				puts("---------------------------------");
-			}
-		}
+		return GetState().queue.GetOverflowCount();
 	}
 
 private:
 
-	bool enabled;
+	static const uint8_t fileVersion = 1;
+
+	enum class RecordKind : uint8_t
+	{
+		MidiInput, MidiOutput, Misc
+	};
+
+	// Queued record. Only the misc records own a heap block (the text).
+	struct Record
+	{
+		uint64_t timestamp;
+		RecordKind kind;
+		MidiMessage message;
+		std::string* text;
+	};
+
+	std::atomic<bool> enabled;
+	std::atomic<bool> running;
+
+	MessageQueue<Record> queue;
+
+	// Writer thread and its state.
+	std::thread writerThread;
+	std::atomic<bool> stopWriterThread;
+	FILE* file;
 	int rowCount;
+	uint64_t reportedDrops;
 
 	Logger()
+		: queue(queueSize), file(nullptr), rowCount(-1), reportedDrops(0)
 	{
-		rowCount = -1;
+		enabled = false;
+		running = false;
+		stopWriterThread = false;
+	}
+
+	// Also runs on exit() (e.g. a failed assertion): the thread must not outlive it.
+	~Logger()
+	{
+		StopWriter();
+	}
+
+	void StopWriter()
+	{
+		if (!running) return;
+		running = false;
+		stopWriterThread = true;
+		writerThread.join();
+
+		if (file != nullptr)
+		{
+			fclose(file);
+			file = nullptr;
+		}
 	}
 
 	static Logger& GetState()
@@ -95,6 +172,97 @@ private:
 		return state;
 	}
 
+	// Push a record (any thread).
+	static void PushMessage(const MidiMessage& message, RecordKind kind)
+	{
+		Logger& state = GetState();
+		if (!state.running || (!state.enabled && state.file == nullptr)) return;
+
+		Record record;
+		record.timestamp = Platform::GetTimestamp();
+		record.kind = kind;
+		record.message = message;
+		record.text = nullptr;
+		state.queue.TryPush(record);
+	}
+
+	static void PushText(const char* text)
+	{
+		Record record;
+		record.timestamp = Platform::GetTimestamp();
+		record.kind = RecordKind::Misc;
+		record.text = new std::string(text);
+		if (!GetState().queue.TryPush(record)) delete record.text;
+	}
+
+	// Writer thread loop. It polls instead of waiting on the queue so that
+	// the producers never have to wake it up.
+	void RunWriterLoop()
+	{
+		while (true)
+		{
+			bool stopping = stopWriterThread;
+
+			Record record;
+			while (queue.TryPop(record)) WriteRecord(record);
+
+			uint64_t drops = queue.GetOverflowCount();
+			if (drops != reportedDrops && enabled)
+			{
+				if (rowCount >= 0) PrintSeparator(true);
+				printf("Logger: %llu records dropped.\n", static_cast<unsigned long long>(drops - reportedDrops));
+				rowCount = -1;
+				reportedDrops = drops;
+			}
+
+			if (file != nullptr) fflush(file);
+			fflush(stdout);
+
+			if (stopping) break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	void WriteRecord(Record& record)
+	{
+		if (record.kind == RecordKind::Misc)
+		{
+			if (enabled)
+			{
+				if (rowCount >= 0) PrintSeparator(true);
+				puts(record.text->c_str());
+				rowCount = -1;
+			}
+			delete record.text;
+		}
+		else if (file != nullptr)
+		{
+			uint8_t data[16] = { 0 };
+			for (int i = 0; i < 8; i++) data[i] = static_cast<uint8_t>(record.timestamp >> (i * 8));
+			data[8] = static_cast<uint8_t>(record.kind);
+			memcpy(data + 9, record.message.bytes, 4);
+			fwrite(data, 1, sizeof(data), file);
+		}
+		else if (enabled)
+		{
+			PrintMidiHeaderWithInterval();
+			PrintMidiMessage(record.message, record.kind == RecordKind::MidiInput ? "IN" : "OUT");
+		}
+	}
+
+	// Print a separator.
+	static void PrintSeparator(bool column = false)
+	{
+		if (column)
+		{
+			puts("-----+----------+----+-----------");
+		}
+		else
+		{
+			puts("---------------------------------");
+		}
+	}
+
 	// Print a header for MIDI records.
 	static void PrintMidiHeader()
 	{
@@ -102,17 +270,16 @@ private:
 		puts(" I/O | Event    | Ch | Data");
 		puts("-----+----------+----+-----------");
 	}
-	static void PrintMidiHeaderWithInterval()
+	void PrintMidiHeaderWithInterval()
 	{
-		Logger& state = GetState();
-		if (state.rowCount < 0 || state.rowCount++ >= 20) {
+		if (rowCount < 0 || rowCount++ >= 20) {
 			PrintMidiHeader();
-			state.rowCount = 0;
+			rowCount = 0;
 		}
 	}
 
 	// Print a MIDI message.
-	static void PrintMidiMessage(MidiMessage& message, const char* ioLabel)
+	static void PrintMidiMessage(const MidiMessage& message, const char* ioLabel)
 	{
 		static const char *statusLabels[] =
 		{
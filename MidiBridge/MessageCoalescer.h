@@ -0,0 +1,107 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MidiMessage.h"
+
+// Thins out the continuous controller messages in a batch (last value wins).
+//
+// Only the last message is kept for each controller and channel, and
+// likewise for pitch bend, channel pressure and polyphonic pressure. Notes,
+// system and SysEx messages always pass, and so do the controllers whose
+// every value matters (bank select, pedals, RPN/NRPN, channel mode). The
+// survivors keep their order, so a kept value stays after the notes it
+// followed.
+class MessageCoalescer
+{
+public:
+
+	MessageCoalescer()
+		: generation(0), thinnedCount(0)
+	{
+		memset(stamps, 0, sizeof(stamps));
+	}
+
+	// Thin a batch in place. Returns the new count.
+	int Thin(MidiEvent* events, int count)
+	{
+		if (++generation == 0)
+		{
+			// The stamps wrapped around: start over.
+			memset(stamps, 0, sizeof(stamps));
+			generation = 1;
+		}
+
+		// Walk backwards so that the last message of each key is seen first,
+		// packing the survivors at the end of the batch.
+		int write = count;
+		for (int i = count - 1; i >= 0; i--)
+		{
+			int key = GetKey(events[i]);
+			if (key >= 0)
+			{
+				if (stamps[key] == generation) continue;
+				stamps[key] = generation;
+			}
+			events[--write] = events[i];
+		}
+
+		int kept = count - write;
+		if (write > 0) std::move(events + write, events + count, events);
+		thinnedCount += write;
+		return kept;
+	}
+
+	// Number of the messages discarded so far.
+	uint64_t GetThinnedCount() const
+	{
+		return thinnedCount;
+	}
+
+private:
+
+	// Key ranges: CC and poly pressure per (channel, number), pitch bend and
+	// channel pressure per channel.
+	static const int ccBase = 0;
+	static const int polyPressureBase = ccBase + 16 * 128;
+	static const int pitchBendBase = polyPressureBase + 16 * 128;
+	static const int channelPressureBase = pitchBendBase + 16;
+	static const int keyCount = channelPressureBase + 16;
+
+	uint32_t stamps[keyCount];
+	uint32_t generation;
+	uint64_t thinnedCount;
+
+	// Controllers which must pass: bank select (0, 32) belongs to the next
+	// program change, the switch pedals (64-69) to the notes around them,
+	// the RPN/NRPN sequences (6, 38, 96-101) only make sense as a whole and
+	// the channel mode messages (120-127) act like notes.
+	static bool IsPassingController(uint8_t number)
+	{
+		return number == 0 || number == 32 || (number >= 64 && number <= 69) ||
+			number == 6 || number == 38 || (number >= 96 && number <= 101) || number >= 120;
+	}
+
+	// Returns the coalescing key of a message, or -1 if it must pass.
+	static int GetKey(const MidiEvent& event)
+	{
+		if (event.sysex != nullptr) return -1;
+
+		uint8_t status = event.message.bytes[0];
+		int channel = status & 0x0f;
+
+		switch (status & 0xf0)
+		{
+		case 0xb0:
+			if (IsPassingController(event.message.bytes[1])) return -1;
+			return ccBase + channel * 128 + (event.message.bytes[1] & 0x7f);
+		case 0xa0:
+			return polyPressureBase + channel * 128 + (event.message.bytes[1] & 0x7f);
+		case 0xe0:
+			return pitchBendBase + channel;
+		case 0xd0:
+			return channelPressureBase + channel;
+		default:
+			return -1;
+		}
+	}
+};
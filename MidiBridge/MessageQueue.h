@@ -0,0 +1,133 @@
+#pragma once
+
+#include "stdafx.h"
+
+// Bounded lock-free queue for handing messages to a single consumer thread.
+// Any number of threads can push concurrently; only one thread may pop.
+template <typename T>
+class MessageQueue
+{
+public:
+
+	// The capacity is rounded up to a power of two.
+	MessageQueue(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity) size <<= 1;
+
+		cells.reset(new Cell[size]);
+		mask = size - 1;
+
+		for (size_t i = 0; i < size; i++)
+		{
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		enqueuePosition.store(0, std::memory_order_relaxed);
+		dequeuePosition = 0;
+		overflowCount.store(0, std::memory_order_relaxed);
+		consumerWaiting.store(false);
+	}
+
+	// Push an item (producers). Returns false and counts an overflow when full.
+	bool TryPush(const T& item)
+	{
+		size_t position = enqueuePosition.load(std::memory_order_relaxed);
+		Cell* cell;
+
+		while (true)
+		{
+			cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+			if (diff == 0)
+			{
+				if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+			}
+			else if (diff < 0)
+			{
+				overflowCount.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			else
+			{
+				position = enqueuePosition.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->data = item;
+		cell->sequence.store(position + 1, std::memory_order_release);
+
+		// Wake up the consumer only when it's sleeping.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (consumerWaiting.load(std::memory_order_relaxed)) Notify();
+
+		return true;
+	}
+
+	// Pop an item (consumer). Returns false when empty.
+	bool TryPop(T& item)
+	{
+		Cell& cell = cells[dequeuePosition & mask];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		if (sequence != dequeuePosition + 1) return false;
+
+		item = cell.data;
+		cell.sequence.store(dequeuePosition + mask + 1, std::memory_order_release);
+		dequeuePosition++;
+		return true;
+	}
+
+	// Check if there is nothing to pop (consumer).
+	bool IsEmpty() const
+	{
+		const Cell& cell = cells[dequeuePosition & mask];
+		return cell.sequence.load(std::memory_order_acquire) != dequeuePosition + 1;
+	}
+
+	// Block the consumer until an item arrives, Notify() is called or the timeout expires.
+	template <typename Duration>
+	void Wait(Duration timeout)
+	{
+		std::unique_lock<std::mutex> lock(waitMutex);
+		consumerWaiting.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (IsEmpty()) waitCondition.wait_for(lock, timeout);
+		consumerWaiting.store(false, std::memory_order_relaxed);
+	}
+
+	// Wake up the consumer.
+	void Notify()
+	{
+		std::lock_guard<std::mutex> guard(waitMutex);
+		waitCondition.notify_one();
+	}
+
+	// Number of the items rejected because the queue was full.
+	uint64_t GetOverflowCount() const
+	{
+		return overflowCount.load(std::memory_order_relaxed);
+	}
+
+private:
+
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+
+	// Producer and consumer positions are kept on separate cache lines.
+	alignas(64) std::atomic<size_t> enqueuePosition;
+	alignas(64) size_t dequeuePosition;
+	alignas(64) std::atomic<uint64_t> overflowCount;
+
+	// Consumer wake-up.
+	std::atomic<bool> consumerWaiting;
+	std::mutex waitMutex;
+	std::condition_variable waitCondition;
+};
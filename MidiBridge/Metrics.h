@@ -0,0 +1,227 @@
+#pragma once
+
+#include "stdafx.h"
+
+// Runtime counters and latency histograms of the bridge.
+//
+// The hot paths only do relaxed atomic increments; nothing is computed until
+// a report is requested. The metrics are fixed members so that updating one
+// is a direct access, and they are listed by name for the reports.
+class Metrics
+{
+public:
+
+	// Monotonic counter.
+	class Counter
+	{
+	public:
+
+		Counter()
+		{
+			value = 0;
+		}
+
+		void Add(uint64_t n = 1)
+		{
+			value.fetch_add(n, std::memory_order_relaxed);
+		}
+
+		uint64_t Get() const
+		{
+			return value.load(std::memory_order_relaxed);
+		}
+
+	private:
+
+		std::atomic<uint64_t> value;
+	};
+
+	// Log-linear histogram (16 sub-buckets per power of two, about 6%
+	// precision) of non-negative values such as microseconds or bytes.
+	class Histogram
+	{
+	public:
+
+		static const int subBucketBits = 4;
+		static const int subBucketCount = 1 << subBucketBits;
+		static const int bucketCount = (64 - subBucketBits + 1) * subBucketCount;
+
+		Histogram()
+		{
+			for (auto& bucket : buckets) bucket = 0;
+			count = 0;
+			sum = 0;
+			max = 0;
+		}
+
+		void Record(uint64_t value)
+		{
+			buckets[GetIndex(value)].fetch_add(1, std::memory_order_relaxed);
+			count.fetch_add(1, std::memory_order_relaxed);
+			sum.fetch_add(value, std::memory_order_relaxed);
+
+			uint64_t current = max.load(std::memory_order_relaxed);
+			while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+			{
+			}
+		}
+
+		uint64_t GetCount() const
+		{
+			return count.load(std::memory_order_relaxed);
+		}
+
+		uint64_t GetMax() const
+		{
+			return max.load(std::memory_order_relaxed);
+		}
+
+		double GetMean() const
+		{
+			uint64_t n = GetCount();
+			return n > 0 ? static_cast<double>(sum.load(std::memory_order_relaxed)) / n : 0.0;
+		}
+
+		// Value at a percentile (0-100), at the middle of its bucket.
+		uint64_t GetPercentile(double percentile) const
+		{
+			uint64_t n = GetCount();
+			if (n == 0) return 0;
+
+			uint64_t target = static_cast<uint64_t>(n * percentile / 100.0);
+			uint64_t cumulative = 0;
+			for (int i = 0; i < bucketCount; i++)
+			{
+				cumulative += buckets[i].load(std::memory_order_relaxed);
+				if (cumulative > target)
+				{
+					uint64_t low = GetLowerBound(i);
+					uint64_t width = GetLowerBound(i + 1) - low;
+					return std::min(low + width / 2, GetMax());
+				}
+			}
+			return GetMax();
+		}
+
+	private:
+
+		std::atomic<uint64_t> buckets[bucketCount];
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> sum;
+		std::atomic<uint64_t> max;
+
+		// Position of the highest bit set.
+		static int GetMagnitude(uint64_t value)
+		{
+			int magnitude = 0;
+			for (int shift = 32; shift > 0; shift >>= 1)
+			{
+				if (value >> shift)
+				{
+					value >>= shift;
+					magnitude += shift;
+				}
+			}
+			return magnitude;
+		}
+
+		static int GetIndex(uint64_t value)
+		{
+			if (value < subBucketCount) return static_cast<int>(value);
+			int magnitude = GetMagnitude(value);
+			int subBucket = static_cast<int>(value >> (magnitude - subBucketBits)) & (subBucketCount - 1);
+			return (magnitude - subBucketBits + 1) * subBucketCount + subBucket;
+		}
+
+		static uint64_t GetLowerBound(int index)
+		{
+			if (index < subBucketCount) return index;
+			int magnitude = index / subBucketCount + subBucketBits - 1;
+			if (magnitude >= 64) return ~0ULL;
+			uint64_t subBucket = index % subBucketCount;
+			return (subBucketCount + subBucket) << (magnitude - subBucketBits);
+		}
+	};
+
+	// MIDI in -> clients.
+	Counter deviceMessages;
+	Counter deviceSysEx;
+	Counter inputDrops;           // Input queue full.
+	Counter transformDrops;       // Dropped by a transform rule (both directions).
+	Histogram inputLatency;       // Arrival -> handed to the clients (us).
+	Histogram batchSize;          // Messages per send to the clients.
+	Counter bytesToClients;
+	Counter clockUpdates;         // Clock source states sent to the clients.
+
+	// Clients -> MIDI out.
+	Counter receiveCalls;
+	Histogram receiveSize;        // Bytes per recv.
+	Counter clientMessages;
+	Counter clientSysEx;
+	Counter clientTimedMessages;
+	Counter outputMessages;       // Queued to the output devices.
+	Counter outputDrops;          // Output queue full.
+	Histogram outputQueueLatency; // Queued -> driver call (us).
+	Histogram outputSendTime;     // Driver call (us).
+	Histogram schedulerLateness;  // Timed message emitted after its time (us).
+
+	static Metrics& Get()
+	{
+		static Metrics metrics;
+		return metrics;
+	}
+
+	// Append the metrics as "name value" lines.
+	void Report(std::string& text) const
+	{
+		for (auto& entry : counters) AppendLine(text, entry.first, entry.second->Get());
+
+		for (auto& entry : histograms)
+		{
+			std::string name = entry.first;
+			const Histogram& histogram = *entry.second;
+			AppendLine(text, name + ".count", histogram.GetCount());
+			AppendLine(text, name + ".mean", static_cast<uint64_t>(histogram.GetMean() + 0.5));
+			AppendLine(text, name + ".p50", histogram.GetPercentile(50));
+			AppendLine(text, name + ".p99", histogram.GetPercentile(99));
+			AppendLine(text, name + ".p999", histogram.GetPercentile(99.9));
+			AppendLine(text, name + ".max", histogram.GetMax());
+		}
+	}
+
+	static void AppendLine(std::string& text, const std::string& name, uint64_t value)
+	{
+		text += name;
+		text += ' ';
+		text += std::to_string(value);
+		text += '\n';
+	}
+
+private:
+
+	std::vector<std::pair<std::string, const Counter*>> counters;
+	std::vector<std::pair<std::string, const Histogram*>> histograms;
+
+	Metrics()
+	{
+		counters.emplace_back("device.messages", &deviceMessages);
+		counters.emplace_back("device.sysex", &deviceSysEx);
+		counters.emplace_back("input.drops", &inputDrops);
+		counters.emplace_back("transform.drops", &transformDrops);
+		counters.emplace_back("ipc.bytes_sent", &bytesToClients);
+		counters.emplace_back("clock.updates", &clockUpdates);
+		counters.emplace_back("ipc.receive_calls", &receiveCalls);
+		counters.emplace_back("client.messages", &clientMessages);
+		counters.emplace_back("client.sysex", &clientSysEx);
+		counters.emplace_back("client.timed_messages", &clientTimedMessages);
+		counters.emplace_back("output.messages", &outputMessages);
+		counters.emplace_back("output.drops", &outputDrops);
+
+		histograms.emplace_back("input.latency_us", &inputLatency);
+		histograms.emplace_back("ipc.batch_size", &batchSize);
+		histograms.emplace_back("ipc.receive_size", &receiveSize);
+		histograms.emplace_back("output.queue_latency_us", &outputQueueLatency);
+		histograms.emplace_back("output.send_time_us", &outputSendTime);
+		histograms.emplace_back("scheduler.lateness_us", &schedulerLateness);
+	}
+};
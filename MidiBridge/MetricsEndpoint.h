@@ -0,0 +1,80 @@
+#pragma once
+
+#include "stdafx.h"
+#include "LocalEndpoint.h"
+
+// Local TCP endpoint serving the metrics report.
+//
+// A connection receives the current report as "name value" lines and is
+// closed, so any tool can read it (e.g. "nc localhost 52365"). It listens on
+// the loopback interface only and runs on its own thread, away from the
+// message paths.
+class MetricsEndpoint
+{
+public:
+
+	// Provider of the report text (endpoint thread).
+	class ReportDelegate
+	{
+	public:
+		virtual std::string GetMetricsReport() = 0;
+	};
+
+	static const int defaultPortNumber = 52365;
+
+	MetricsEndpoint(ReportDelegate& rd)
+		: reportDelegate(rd), listenSocket(LocalEndpoint::invalidSocket)
+	{
+		stopEndpointThread = false;
+	}
+
+	~MetricsEndpoint()
+	{
+		Stop();
+	}
+
+	// Start listening. Returns false if the port is not available.
+	bool Start(int port)
+	{
+		Stop();
+
+		listenSocket = LocalEndpoint::Listen(port);
+		if (listenSocket == LocalEndpoint::invalidSocket) return false;
+
+		stopEndpointThread = false;
+		endpointThread = std::thread(&MetricsEndpoint::RunEndpoint, this);
+		return true;
+	}
+
+	void Stop()
+	{
+		if (listenSocket == LocalEndpoint::invalidSocket) return;
+		stopEndpointThread = true;
+		endpointThread.join();
+		LocalEndpoint::CloseSocket(listenSocket);
+		listenSocket = LocalEndpoint::invalidSocket;
+	}
+
+private:
+
+	ReportDelegate& reportDelegate;
+	LocalEndpoint::socket_t listenSocket;
+	std::thread endpointThread;
+	std::atomic<bool> stopEndpointThread;
+
+	// Endpoint thread. The wait is bounded to see the stop request.
+	void RunEndpoint()
+	{
+		while (!stopEndpointThread)
+		{
+			if (!LocalEndpoint::WaitForInput(listenSocket, 200)) continue;
+
+			LocalEndpoint::socket_t socket = accept(listenSocket, nullptr, nullptr);
+			if (socket == LocalEndpoint::invalidSocket) continue;
+
+			// A blocking send of a few kilobytes to a local reader.
+			LocalEndpoint::SendAll(socket, reportDelegate.GetMetricsReport());
+			LocalEndpoint::CloseSocket(socket);
+		}
+	}
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "stdafx.h"
+#include "SysExBuffer.h"
+
+// Interface to a MIDI device layer (system driver or virtual devices).
+class MidiBackend
+{
+public:
+
+	// Opaque handle of an opened device.
+	typedef uintptr_t Handle;
+
+	// Receiver of the messages coming from the opened input devices.
+	// The driver time is in milliseconds from the start of the device.
+	// A SysEx buffer must be released by the handler once it's dispatched,
+	// outside the callback. An empty one (length 0) only has to be released.
+	class InputHandler
+	{
+	public:
+		virtual void ProcessBackendInput(Handle handle, uint32_t raw32, uint32_t driverTime) = 0;
+		virtual void ProcessBackendLongInput(Handle handle, SysExBuffer* buffer, uint32_t driverTime) = 0;
+		virtual void ProcessBackendInputClosed(Handle handle) = 0;
+	};
+
+	virtual ~MidiBackend()
+	{
+	}
+
+	// Device enumeration.
+	virtual unsigned int GetInputCount() = 0;
+	virtual unsigned int GetOutputCount() = 0;
+	virtual std::string GetInputName(unsigned int id) = 0;
+	virtual std::string GetOutputName(unsigned int id) = 0;
+
+	// Input devices.
+	virtual bool OpenInput(unsigned int id, InputHandler& handler, Handle& handle) = 0;
+	virtual bool StartInput(Handle handle) = 0;
+	virtual void CloseInput(Handle handle) = 0;
+	virtual bool GetInputId(Handle handle, unsigned int& id) = 0;
+
+	// Output devices.
+	virtual bool OpenOutput(unsigned int id, Handle& handle) = 0;
+	virtual void CloseOutput(Handle handle) = 0;
+	virtual bool GetOutputId(Handle handle, unsigned int& id) = 0;
+	virtual bool SendShort(Handle handle, uint32_t raw32) = 0;
+	virtual bool SendLong(Handle handle, const uint8_t* data, size_t length) = 0;
+};
@@ -2,11 +2,17 @@
 
 #include "stdafx.h"
 #include "Debug.h"
+#include "DeviceRegistry.h"
 #include "Logger.h"
 #include "MidiMessage.h"
+#include "MidiCodec.h"
+#include "MidiBackend.h"
+#include "OutputPort.h"
+#include "Platform.h"
+#include "RoutingTable.h"
 
 // MIDI interface client class.
-class MidiClient
+class MidiClient : MidiBackend::InputHandler
 {
 public:
 
@@ -14,26 +20,35 @@ public:
     class MessageDelegate
     {
     public:
-        virtual void ProcessIncomingMidiMessageFromDevice(MidiMessage message) = 0;
+        virtual void ProcessIncomingMidiMessageFromDevice(const MidiEvent& event) = 0;
+        virtual void ProcessIncomingSysExFromDevice(const MidiEvent& event) = 0;
     };
 
     // Constructor/destructor.
-    MidiClient(MessageDelegate& md)
-        : messageDelegate(md)
+    MidiClient(MessageDelegate& md, MidiBackend& backend)
+        : messageDelegate(md), backend(backend), outputs(std::make_shared<OutputList>())
     {
+        transitioning = false;
+        deferredCount = 0;
+        deferredDropCount = 0;
+        stopWatcherThread = false;
+        rescanRequested = false;
+        closingInput = 0;
     }
 
     ~MidiClient()
     {
+        StopDeviceWatcher();
         CloseAllDevices();
     }
 
 	void TrySwitchState(int id)
 	{
-		std::lock_guard<std::mutex> gurad(handleMutex);
+		std::lock_guard<std::mutex> gurad(deviceChangeMutex);
 
-		int inDeviceCount = midiInGetNumDevs();
-		int outDeviceCount = midiOutGetNumDevs();
+		// The IDs are the ones of the printed list (the cached enumeration).
+		int inDeviceCount = registry.GetInputCount();
+		int outDeviceCount = registry.GetOutputCount();
 
 		if (id <= 0 || id > inDeviceCount + outDeviceCount) {
 			// Invalid ID.
@@ -44,13 +59,15 @@ public:
 			id = id - 1;
 			if (CheckInputDeviceOpened(id))
 			{
-				// Try to close the device.
+				// Try to close the device. A rescan leaves it closed.
 				CloseInputDevice(id);
+				SetClosedByUser(false, id, true);
 			}
 			else
 			{
 				// Try to open the device.
 				TryOpenInputDevice(id);
+				SetClosedByUser(false, id, false);
 			}
 		}
 		else
@@ -58,13 +75,15 @@ public:
 			id = id - 1 - inDeviceCount;
 			if (CheckOutputDeviceOpened(id))
 			{
-				// Try to close the device.
+				// Try to close the device. A rescan leaves it closed.
 				CloseOutputDevice(id);
+				SetClosedByUser(true, id, true);
 			}
 			else
 			{
 				// Try to open the device.
 				TryOpenOutputDevice(id);
+				SetClosedByUser(true, id, false);
 			}
 		}
 	}
@@ -72,7 +91,13 @@ public:
 	// Print the device list.
 	void PrintDeviceList()
 	{
-		std::lock_guard<std::mutex> gurad(handleMutex);
+		// Copy the table and print without holding the lock.
+		DeviceRegistry::DeviceList inDevices, outDevices;
+		{
+			std::lock_guard<std::mutex> gurad(handleMutex);
+			inDevices = registry.GetInputs();
+			outDevices = registry.GetOutputs();
+		}
 
 		// Header.
 		puts("----+--------+--------------+----------------------------------");
@@ -80,194 +105,580 @@ public:
 		puts("----+--------+--------------+----------------------------------");
 
 		// Input devices.
-		auto inDeviceCount = midiInGetNumDevs();
+		auto inDeviceCount = static_cast<unsigned int>(inDevices.size());
 		for (auto i = 0U; i < inDeviceCount; i++)
 		{
-			MIDIINCAPS caps;
-			auto result = midiInGetDevCaps(i, &caps, sizeof(caps));
-			Debug::Assert(result == MMSYSERR_NOERROR, "Failed to retrieve the device caps.");
-			bool opened = CheckInputDeviceOpened(i);
-			wprintf(L" %2d | Input  | %-12s | %-32s\n", i + 1, opened ? L"Active" : L"", caps.szPname);
+			printf(" %2d | Input  | %-12s | %-32s\n", i + 1, inDevices[i].opened ? "Active" : "", inDevices[i].name.c_str());
 		}
 
 		puts("----+--------+--------------+----------------------------------");
 
 		// Output devices.
-		auto outDeviceCount = midiOutGetNumDevs();
-		for (auto i = 0U; i < outDeviceCount; i++)
+		for (auto i = 0U; i < outDevices.size(); i++)
 		{
-			MIDIOUTCAPS caps;
-			auto result = midiOutGetDevCaps(i, &caps, sizeof(caps));
-			Debug::Assert(result == MMSYSERR_NOERROR, "Failed to retrieve the device caps.");
-			bool opened = CheckOutputDeviceOpened(i);
-			wprintf(L" %2d | Output | %-12s | %-32s\n", i + 1 + inDeviceCount, opened ? L"Active" : L"", caps.szPname);
+			printf(" %2d | Output | %-12s | %-32s\n", i + 1 + inDeviceCount, outDevices[i].opened ? "Active" : "", outDevices[i].name.c_str());
 		}
 
 		puts("----+--------+--------------+----------------------------------");
 	}
 
+	// Print the queue and driver statistics of the opened outputs.
+	void PrintOutputStats()
+	{
+		auto stats = GetOutputStats();
+		DeviceRegistry::DeviceList outDevices;
+		unsigned int inDeviceCount;
+		{
+			std::lock_guard<std::mutex> gurad(handleMutex);
+			outDevices = registry.GetOutputs();
+			inDeviceCount = registry.GetInputCount();
+		}
+
+		puts("-------+-------+------------+----------+-----------+----------+-----------------");
+		puts(" ID    | DEPTH |       SENT |  DROPPED | AVG (us)  | MAX (us) | DEVICE NAME");
+		puts("-------+-------+------------+----------+-----------+----------+-----------------");
+
+		for (auto& port : stats)
+		{
+			double average = port.sent > 0 ? static_cast<double>(port.sendTimeTotal) / port.sent : 0.0;
+			const char* name = port.id < outDevices.size() ? outDevices[port.id].name.c_str() : "";
+			printf(" %5u | %5llu | %10llu | %8llu | %9.1f | %8llu | %s\n",
+				port.id + 1 + inDeviceCount,
+				static_cast<unsigned long long>(port.depth), static_cast<unsigned long long>(port.sent),
+				static_cast<unsigned long long>(port.dropped), average,
+				static_cast<unsigned long long>(port.sendTimeMax), name);
+		}
+
+		puts("-------+-------+------------+----------+-----------+----------+-----------------");
+	}
+
     // Try to open the all devices.
     void OpenAllDevices()
     {
-		std::lock_guard<std::mutex> gurad(handleMutex);
-	
-		auto inDeviceCount = midiInGetNumDevs();
-        for (auto i = 0U; i < inDeviceCount; i++)
-        {
-			TryOpenInputDevice(i);
-        }
-
-        auto outDeviceCount = midiOutGetNumDevs();
-        for (auto i = 0U; i < outDeviceCount; i++)
-        {
-			TryOpenOutputDevice(i);
-        }
+		{
+			std::lock_guard<std::mutex> changeGuard(deviceChangeMutex);
+			std::lock_guard<std::mutex> gurad(handleMutex);
+			registry.ClearClosedByUser();
+		}
+		RescanDevices();
     }
 
     // Close the all devices opened by this client.
     void CloseAllDevices()
     {
-		std::lock_guard<std::mutex> gurad(handleMutex);
-	
-		for (auto& handle : inDeviceHandles)
-        {
-            midiInClose(handle);
-        }
-        inDeviceHandles.clear();
+		std::lock_guard<std::mutex> changeGuard(deviceChangeMutex);
 
-        for (auto& handle : outDeviceHandles)
+		for (auto i = 0U; i < registry.GetInputCount(); i++)
         {
-            midiOutClose(handle);
+			if (registry.IsInputOpened(i)) CloseInputDevice(i);
         }
-        outDeviceHandles.clear();
+
+		{
+			std::lock_guard<std::mutex> gurad(handleMutex);
+			for (auto i = 0U; i < registry.GetOutputCount(); i++) registry.SetOutputOpened(i, false);
+		}
+
+        // The senders only hold a snapshot for a send: wait for the ports.
+        PublishOutputs(OutputList());
+        ReleaseRetiredOutputs(true);
+    }
+
+    // Rescan and grab the all devices.
+    void ReopenAllDevices()
+    {
+		// Hold the outgoing messages while no device set is available.
+		BeginTransition();
+		CloseAllDevices();
+		OpenAllDevices();
+		EndTransition();
+    }
+
+	// Incremental rescan: open the new devices and close the vanished ones.
+	// A device is identified by its index and name; the devices still present
+	// keep running and the senders are never held.
+	//
+	// The driver calls are made without handleMutex, so the device list can
+	// be printed while a slow driver opens; only the registry updates take it.
+	void RescanDevices()
+	{
+		std::lock_guard<std::mutex> changeGuard(deviceChangeMutex);
+
+		std::vector<std::string> inNames, outNames;
+		GetDeviceNames(inNames, outNames);
+
+		int openedCount = 0;
+		int closedCount = 0;
+
+		// Close the devices which vanished or changed.
+		for (auto i = 0U; i < registry.GetInputCount(); i++)
+		{
+			if (i < inNames.size() && registry.GetInput(i).name == inNames[i]) continue;
+			if (registry.IsInputOpened(i))
+			{
+				CloseInputDevice(i);
+				closedCount++;
+			}
+		}
+
+		OutputList list;
+		for (auto& port : *outputs)
+		{
+			if (port->GetId() < outNames.size() && registry.GetOutput(port->GetId()).name == outNames[port->GetId()])
+			{
+				list.push_back(port);
+			}
+			else
+			{
+				closedCount++;
+			}
+		}
+		bool outputsChanged = list.size() != outputs->size();
+
+		{
+			std::lock_guard<std::mutex> gurad(handleMutex);
+			registry.SetNames(inNames, outNames);
+		}
+
+		// Open the new ones. The output set is published once, only if it changed.
+		for (auto i = 0U; i < registry.GetInputCount(); i++)
+		{
+			if (registry.IsInputOpened(i) || registry.GetInput(i).closedByUser) continue;
+			if (TryOpenInputDevice(i)) openedCount++;
+		}
+
+		for (auto i = 0U; i < registry.GetOutputCount(); i++)
+		{
+			if (registry.IsOutputOpened(i) || registry.GetOutput(i).closedByUser) continue;
+			auto port = OpenOutputPort(i);
+			if (port)
+			{
+				list.push_back(port);
+				outputsChanged = true;
+				openedCount++;
+			}
+		}
+
+		if (outputsChanged) PublishOutputs(std::move(list));
+
+		if (openedCount > 0 || closedCount > 0)
+		{
+			Logger::RecordMisc("Rescan: %d devices opened, %d closed.", openedCount, closedCount);
+		}
+	}
+
+	// Start/stop the thread polling the device list. It rescans when the list
+	// changes or when a driver reports a closed input.
+	void StartDeviceWatcher(int intervalMs)
+	{
+		StopDeviceWatcher();
+		stopWatcherThread = false;
+		watcherThread = std::thread(&MidiClient::RunDeviceWatcher, this, intervalMs);
+	}
+
+	void StopDeviceWatcher()
+	{
+		if (!watcherThread.joinable()) return;
+		{
+			std::lock_guard<std::mutex> guard(watcherMutex);
+			stopWatcherThread = true;
+		}
+		watcherCondition.notify_one();
+		watcherThread.join();
+	}
+
+    // Send a MIDI message to the output devices in the mask (RoutingTable::GetBit).
+    void SendMessageToDevices(MidiMessage message, uint64_t outputMask = RoutingTable::all)
+    {
+		if (transitioning.load(std::memory_order_acquire) && DeferMessage(message, outputMask)) return;
+
+		// Wait-free read of the current device set.
+		auto snapshot = std::atomic_load(&outputs);
+		for (auto& port : *snapshot)
+		{
+			if (outputMask & RoutingTable::GetBit(port->GetId())) port->Send(message.GetRaw32());
+		}
     }
 
-    // Send a MIDI message to the all output devices.
-    void SendMessageToDevices(MidiMessage message)
+    // Send a batch of messages, each to the output devices in its mask.
+    // The device set is read once and each device gets its messages in order.
+    void SendMessagesToDevices(const MidiMessage* messages, const uint64_t* outputMasks, int count)
     {
-		// Only send if the mutex isn't locked.
-		if (handleMutex.try_lock())
+		if (transitioning.load(std::memory_order_acquire))
 		{
-			for (auto& handle : outDeviceHandles)
+			for (int i = 0; i < count; i++) SendMessageToDevices(messages[i], outputMasks[i]);
+			return;
+		}
+
+		// Converted to the driver form once for all the devices.
+		static const int chunkSize = 64;
+		uint32_t raw[chunkSize];
+
+		auto snapshot = std::atomic_load(&outputs);
+		for (int offset = 0; offset < count; offset += chunkSize)
+		{
+			int chunk = std::min(chunkSize, count - offset);
+			MidiCodec::Decode(messages + offset, raw, chunk);
+
+			for (auto& port : *snapshot)
 			{
-				midiOutShortMsg(handle, message.GetRaw32());
+				uint64_t bit = RoutingTable::GetBit(port->GetId());
+				for (int i = 0; i < chunk; i++)
+				{
+					if (outputMasks[offset + i] & bit) port->Send(raw[i]);
+				}
 			}
-			handleMutex.unlock();
 		}
     }
 
+    // Send a SysEx message to the output devices in the mask.
+    // Not deferred during a transition: it's counted as a drop instead.
+    void SendSysExToDevices(const uint8_t* data, size_t length, uint64_t outputMask = RoutingTable::all)
+    {
+		if (transitioning.load(std::memory_order_acquire))
+		{
+			std::lock_guard<std::mutex> guard(deferredMutex);
+			deferredDropCount++;
+			return;
+		}
+
+		auto snapshot = std::atomic_load(&outputs);
+		for (auto& port : *snapshot)
+		{
+			if (outputMask & RoutingTable::GetBit(port->GetId())) port->SendLong(data, length);
+		}
+    }
+
+	// Queue and driver statistics of the opened outputs.
+	std::vector<OutputPort::Stats> GetOutputStats()
+	{
+		std::vector<OutputPort::Stats> stats;
+		auto snapshot = std::atomic_load(&outputs);
+		for (auto& port : *snapshot) stats.push_back(port->GetStats());
+		return stats;
+	}
+
+	// Number of messages held back during device transitions.
+	uint64_t GetDeferredMessageCount()
+	{
+		std::lock_guard<std::mutex> guard(deferredMutex);
+		return deferredCount;
+	}
+
+	// Number of messages discarded because the deferred buffer was full.
+	uint64_t GetDeferredDropCount()
+	{
+		std::lock_guard<std::mutex> guard(deferredMutex);
+		return deferredDropCount;
+	}
+
 private:
 
+	// Opened output devices. A port is closed when it's released from the retired list.
+	typedef std::vector<std::shared_ptr<OutputPort>> OutputList;
+
+	// Message held during a device transition, with its routing.
+	struct DeferredMessage
+	{
+		MidiMessage message;
+		uint64_t outputMask;
+	};
+
+	// Max number of messages held during a device transition.
+	static const size_t deferredLimit = 4096;
+
     MessageDelegate& messageDelegate;
-    std::vector<HMIDIIN> inDeviceHandles;
-    std::vector<HMIDIOUT> outDeviceHandles;
+    MidiBackend& backend;
+
+	// Serializes the device changes (open, close, rescan), which call the drivers.
+	std::mutex deviceChangeMutex;
+
+	// Guards the registry only; never held across a driver call.
 	std::mutex handleMutex;
 
-	// Check if the device is already opened.
-	bool CheckInputDeviceOpened(int id)
+	// Enumerated devices and their state. Modified under both locks, so it
+	// can be read under either of them.
+	DeviceRegistry registry;
+
+	// Device watcher thread.
+	std::thread watcherThread;
+	std::mutex watcherMutex;
+	std::condition_variable watcherCondition;
+	bool stopWatcherThread;
+	std::atomic<bool> rescanRequested;
+
+	// Input being closed by the client: its close notification is not a disconnection.
+	std::atomic<MidiBackend::Handle> closingInput;
+
+	// Current output device set. Replaced as a whole (copy on write) under deviceChangeMutex
+	// and read without locking by the senders.
+	std::shared_ptr<const OutputList> outputs;
+
+	// Ports taken out of the set. They are torn down (worker join, driver
+	// close) by the device change threads once no snapshot refers to them,
+	// never by a sender dropping the last snapshot. Under deviceChangeMutex.
+	OutputList retiredOutputs;
+
+	// Messages deferred during a device transition.
+	std::atomic<bool> transitioning;
+	std::vector<DeferredMessage> deferredMessages;
+	std::mutex deferredMutex;
+	uint64_t deferredCount;
+	uint64_t deferredDropCount;
+
+	// Replace the output device set. The ports left out are retired.
+	void PublishOutputs(OutputList list)
 	{
-		for (auto handle : inDeviceHandles)
+		for (auto& port : *outputs)
 		{
-			UINT idFromHandle;
-			if (midiInGetID(handle, &idFromHandle) == MMSYSERR_NOERROR)
+			if (std::find(list.begin(), list.end(), port) == list.end()) retiredOutputs.push_back(port);
+		}
+
+		std::shared_ptr<const OutputList> snapshot = std::make_shared<OutputList>(std::move(list));
+		std::atomic_store(&outputs, snapshot);
+		ReleaseRetiredOutputs(false);
+	}
+
+	// Tear down the retired ports which no snapshot refers to anymore,
+	// waiting for all of them if asked.
+	void ReleaseRetiredOutputs(bool wait)
+	{
+		while (true)
+		{
+			auto end = std::remove_if(retiredOutputs.begin(), retiredOutputs.end(),
+				[](const std::shared_ptr<OutputPort>& port) { return port.use_count() == 1; });
+			retiredOutputs.erase(end, retiredOutputs.end());
+
+			if (!wait || retiredOutputs.empty()) break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	// Start/end a device transition.
+	void BeginTransition()
+	{
+		std::lock_guard<std::mutex> guard(deferredMutex);
+		transitioning.store(true, std::memory_order_release);
+	}
+
+	void EndTransition()
+	{
+		std::lock_guard<std::mutex> guard(deferredMutex);
+
+		// Flush the deferred messages to the new device set before resuming.
+		auto snapshot = std::atomic_load(&outputs);
+		for (auto& deferred : deferredMessages)
+		{
+			for (auto& port : *snapshot)
 			{
-				if (idFromHandle == id) return true;
+				if (deferred.outputMask & RoutingTable::GetBit(port->GetId())) port->Send(deferred.message.GetRaw32());
 			}
 		}
-		return false;
+
+		if (!deferredMessages.empty())
+		{
+			Logger::RecordMisc("Sent %d messages deferred during the device transition.", static_cast<int>(deferredMessages.size()));
+			deferredMessages.clear();
+		}
+
+		transitioning.store(false, std::memory_order_release);
+	}
+
+	// Hold a message until the transition ends. Returns false if it has already ended.
+	bool DeferMessage(MidiMessage message, uint64_t outputMask)
+	{
+		std::lock_guard<std::mutex> guard(deferredMutex);
+		if (!transitioning.load(std::memory_order_relaxed)) return false;
+
+		if (deferredMessages.size() < deferredLimit)
+		{
+			DeferredMessage deferred = { message, outputMask };
+			deferredMessages.push_back(deferred);
+			deferredCount++;
+		}
+		else
+		{
+			deferredDropCount++;
+		}
+		return true;
 	}
 
-	bool CheckOutputDeviceOpened(int id)
+	// Enumerate the current device names.
+	void GetDeviceNames(std::vector<std::string>& inNames, std::vector<std::string>& outNames)
 	{
-		for (auto handle : outDeviceHandles)
+		auto inDeviceCount = backend.GetInputCount();
+		for (auto i = 0U; i < inDeviceCount; i++) inNames.push_back(backend.GetInputName(i));
+
+		auto outDeviceCount = backend.GetOutputCount();
+		for (auto i = 0U; i < outDeviceCount; i++) outNames.push_back(backend.GetOutputName(i));
+	}
+
+	// Device watcher thread. Enumerating the names is cheap next to reopening
+	// the drivers, so the list is simply compared on every poll. It also tears
+	// down the retired ports still in use at the last device change.
+	void RunDeviceWatcher(int intervalMs)
+	{
+		std::vector<std::string> lastInNames, lastOutNames;
+		GetDeviceNames(lastInNames, lastOutNames);
+
+		std::unique_lock<std::mutex> lock(watcherMutex);
+		while (!stopWatcherThread)
 		{
-			UINT idFromHandle;
-			if (midiOutGetID(handle, &idFromHandle) == MMSYSERR_NOERROR)
+			watcherCondition.wait_for(lock, std::chrono::milliseconds(intervalMs));
+			if (stopWatcherThread) break;
+			lock.unlock();
+
+			{
+				std::lock_guard<std::mutex> changeGuard(deviceChangeMutex);
+				ReleaseRetiredOutputs(false);
+			}
+
+			std::vector<std::string> inNames, outNames;
+			GetDeviceNames(inNames, outNames);
+
+			if (rescanRequested.exchange(false) || inNames != lastInNames || outNames != lastOutNames)
 			{
-				if (idFromHandle == id) return true;
+				Logger::RecordMisc("Device change detected.");
+				RescanDevices();
+				lastInNames.swap(inNames);
+				lastOutNames.swap(outNames);
 			}
+
+			lock.lock();
 		}
-		return false;
 	}
 
-	// Try to open an device.
-	bool TryOpenInputDevice(UINT id)
+	// Check if the device is already opened.
+	bool CheckInputDeviceOpened(unsigned int id)
+	{
+		return registry.IsInputOpened(id);
+	}
+
+	bool CheckOutputDeviceOpened(unsigned int id)
+	{
+		return registry.IsOutputOpened(id);
+	}
+
+	void SetClosedByUser(bool output, unsigned int id, bool closed)
 	{
-		HMIDIIN handle;
-		DWORD_PTR callback = reinterpret_cast<DWORD_PTR>(MidiInProc);
-		DWORD_PTR instance = reinterpret_cast<DWORD_PTR>(&messageDelegate);
-		if (midiInOpen(&handle, id, callback, instance, CALLBACK_FUNCTION) == MMSYSERR_NOERROR)
+		std::lock_guard<std::mutex> gurad(handleMutex);
+		registry.SetClosedByUser(output, id, closed);
+	}
+
+	// Try to open an device. The device helpers are called under
+	// deviceChangeMutex and take handleMutex around the registry updates only.
+	bool TryOpenInputDevice(unsigned int id)
+	{
+		MidiBackend::Handle handle;
+		if (backend.OpenInput(id, *this, handle))
 		{
-			if (midiInStart(handle) == MMSYSERR_NOERROR)
+			// Registered first so that the callbacks can find it from the first message.
 			{
-				inDeviceHandles.push_back(handle);
-				return true;
+				std::lock_guard<std::mutex> gurad(handleMutex);
+				registry.SetInputOpened(id, handle);
 			}
-			midiInClose(handle);
+			if (backend.StartInput(handle)) return true;
+			CloseInput(handle);
+
+			std::lock_guard<std::mutex> gurad(handleMutex);
+			registry.SetInputClosed(id);
 		}
 		return false;
 	}
 
-	bool TryOpenOutputDevice(UINT id)
+	bool TryOpenOutputDevice(unsigned int id)
 	{
-		HMIDIOUT handle;
-		DWORD_PTR callback = reinterpret_cast<DWORD_PTR>(MidiInProc);
-		DWORD_PTR instance = reinterpret_cast<DWORD_PTR>(&messageDelegate);
-		if (midiOutOpen(&handle, id, callback, instance, CALLBACK_FUNCTION) == MMSYSERR_NOERROR)
+		auto port = OpenOutputPort(id);
+		if (port)
 		{
-			outDeviceHandles.push_back(handle);
+			OutputList list(*outputs);
+			list.push_back(port);
+			PublishOutputs(std::move(list));
 			return true;
 		}
 		return false;
 	}
 
-	// Try to close the device.
-	void CloseInputDevice(int id)
+	std::shared_ptr<OutputPort> OpenOutputPort(unsigned int id)
 	{
-		for (auto handleItr = inDeviceHandles.begin(); handleItr != inDeviceHandles.end(); ++handleItr)
+		MidiBackend::Handle handle;
+		if (!backend.OpenOutput(id, handle)) return nullptr;
 		{
-			UINT idFromHandle;
-			if (midiInGetID(*handleItr, &idFromHandle) == MMSYSERR_NOERROR)
-			{
-				if (idFromHandle == id)
-				{
-					midiInStop(*handleItr);
-					midiInClose(*handleItr);
-					inDeviceHandles.erase(handleItr);
-					break;
-				}
-			}
+			std::lock_guard<std::mutex> gurad(handleMutex);
+			registry.SetOutputOpened(id, true);
 		}
+		return std::make_shared<OutputPort>(backend, handle, id);
+	}
+
+	// Try to close the device.
+	void CloseInputDevice(unsigned int id)
+	{
+		if (!registry.IsInputOpened(id)) return;
+		CloseInput(registry.GetInput(id).handle);
+
+		std::lock_guard<std::mutex> gurad(handleMutex);
+		registry.SetInputClosed(id);
+	}
+
+	// Close an input handle. The closes are serialized by deviceChangeMutex.
+	void CloseInput(MidiBackend::Handle handle)
+	{
+		closingInput = handle;
+		backend.CloseInput(handle);
+		closingInput = 0;
 	}
 
-	void CloseOutputDevice(int id)
+	void CloseOutputDevice(unsigned int id)
 	{
-		for (auto handleItr = outDeviceHandles.begin(); handleItr != outDeviceHandles.end(); ++handleItr)
+		OutputList list;
+		for (auto& port : *outputs)
 		{
-			UINT idFromHandle;
-			if (midiOutGetID(*handleItr, &idFromHandle) == MMSYSERR_NOERROR)
-			{
-				if (idFromHandle == id)
-				{
-					midiOutClose(*handleItr);
-					outDeviceHandles.erase(handleItr);
-					break;
-				}
-			}
+			if (port->GetId() != id) list.push_back(port);
 		}
+		{
+			std::lock_guard<std::mutex> gurad(handleMutex);
+			registry.SetOutputOpened(id, false);
+		}
+		PublishOutputs(std::move(list));
 	}
 
-	// MIDI callback function.
-    static void CALLBACK MidiInProc(HMIDIIN hMidiIn, UINT wMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
-    {
-        if (wMsg == MIM_DATA)
-        {
-            auto md = reinterpret_cast<MessageDelegate*>(dwInstance);
-            md->ProcessIncomingMidiMessageFromDevice(MidiMessage(dwParam1));
-        }
-        else if (wMsg == MIM_CLOSE)
-        {
-			Logger::RecordMisc("Device (%0x) was disconnected.", hMidiIn);
-        }
-    }
+	// Backend callbacks.
+	void ProcessBackendInput(MidiBackend::Handle handle, uint32_t raw32, uint32_t /* driverTime */) override
+	{
+		// The driver time only has millisecond resolution: stamp it here instead.
+		// The device ID comes from the registry, not from a driver call.
+		MidiEvent event;
+		event.message = MidiMessage(raw32);
+		event.sysex = nullptr;
+		event.timestamp = Platform::GetTimestamp();
+
+		unsigned int id;
+		event.device = registry.FindInput(handle, id) ? static_cast<uint8_t>(id) : 0xff;
+
+		messageDelegate.ProcessIncomingMidiMessageFromDevice(event);
+	}
+
+	void ProcessBackendLongInput(MidiBackend::Handle handle, SysExBuffer* buffer, uint32_t /* driverTime */) override
+	{
+		MidiEvent event;
+		event.message = MidiMessage(0xf0);
+		event.sysex = buffer;
+		event.timestamp = Platform::GetTimestamp();
+
+		unsigned int id;
+		event.device = registry.FindInput(handle, id) ? static_cast<uint8_t>(id) : 0xff;
+
+		messageDelegate.ProcessIncomingSysExFromDevice(event);
+	}
+
+	void ProcessBackendInputClosed(MidiBackend::Handle handle) override
+	{
+		// The driver also reports the closes made by the client itself.
+		if (handle == closingInput) return;
+
+		Logger::RecordMisc("Device (%0llx) was disconnected.", static_cast<unsigned long long>(handle));
+
+		// Let the watcher rescan without waiting for the list to change.
+		rescanRequested = true;
+		watcherCondition.notify_one();
+	}
 };
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MidiMessage.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MIDI_CODEC_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MIDI_CODEC_SSE2
+#endif
+
+// Batch conversion between driver dwords and wire records (MidiMessage).
+//
+// Same results as MidiMessage(uint32_t) and GetRaw32(), several messages at
+// a time: a wire record is a little endian dword, so a vector register holds
+// 4 (SSE2) or 8 (AVX2) of them. The instruction set is chosen at compile
+// time; the remainder and the other targets go through the scalar code.
+struct MidiCodec
+{
+	static_assert(sizeof(MidiMessage) == 4, "MidiMessage must be a packed 4-byte record.");
+
+	// Instruction set of the batch functions.
+	static const char* GetInstructionSet()
+	{
+#if defined(MIDI_CODEC_AVX2)
+		return "avx2";
+#elif defined(MIDI_CODEC_SSE2)
+		return "sse2";
+#else
+		return "scalar";
+#endif
+	}
+
+	// Driver dwords -> wire records.
+	static void Encode(const uint32_t* raw, MidiMessage* messages, size_t count)
+	{
+		size_t i = 0;
+#if defined(MIDI_CODEC_AVX2)
+		for (; i + 8 <= count; i += 8)
+		{
+			__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(raw + i));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(messages + i), EncodeVector(x));
+		}
+#elif defined(MIDI_CODEC_SSE2)
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(messages + i), EncodeVector(x));
+		}
+#endif
+		EncodeScalar(raw + i, messages + i, count - i);
+	}
+
+	// Wire records -> driver dwords.
+	static void Decode(const MidiMessage* messages, uint32_t* raw, size_t count)
+	{
+		size_t i = 0;
+#if defined(MIDI_CODEC_AVX2)
+		for (; i + 8 <= count; i += 8)
+		{
+			__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(messages + i));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(raw + i), DecodeVector(x));
+		}
+#elif defined(MIDI_CODEC_SSE2)
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(messages + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(raw + i), DecodeVector(x));
+		}
+#endif
+		DecodeScalar(messages + i, raw + i, count - i);
+	}
+
+	// One message at a time (the reference for the batch functions).
+	static void EncodeScalar(const uint32_t* raw, MidiMessage* messages, size_t count)
+	{
+		for (size_t i = 0; i < count; i++) messages[i] = MidiMessage(raw[i]);
+	}
+
+	static void DecodeScalar(const MidiMessage* messages, uint32_t* raw, size_t count)
+	{
+		for (size_t i = 0; i < count; i++) raw[i] = messages[i].GetRaw32();
+	}
+
+private:
+
+	// The data length rule of MidiMessage::GetDataLength, evaluated on every
+	// lane with compares instead of the table (there is no byte gather).
+	//   one  : 0xc*, 0xd*, 0xf1, 0xf3
+	//   none : 0xf* except 0xf1-0xf3
+#if defined(MIDI_CODEC_AVX2)
+
+	static __m256i EncodeVector(__m256i x)
+	{
+		__m256i status = _mm256_and_si256(x, _mm256_set1_epi32(0xff));
+		__m256i high = _mm256_and_si256(x, _mm256_set1_epi32(0xf0));
+		__m256i f1 = _mm256_cmpeq_epi32(status, _mm256_set1_epi32(0xf1));
+		__m256i f2 = _mm256_cmpeq_epi32(status, _mm256_set1_epi32(0xf2));
+		__m256i f3 = _mm256_cmpeq_epi32(status, _mm256_set1_epi32(0xf3));
+
+		__m256i one = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi32(high, _mm256_set1_epi32(0xc0)), _mm256_cmpeq_epi32(high, _mm256_set1_epi32(0xd0))),
+			_mm256_or_si256(f1, f3));
+		__m256i none = _mm256_andnot_si256(_mm256_or_si256(_mm256_or_si256(f1, f2), f3), _mm256_cmpeq_epi32(high, _mm256_set1_epi32(0xf0)));
+
+		__m256i keep = _mm256_or_si256(_mm256_set1_epi32(0xff),
+			_mm256_or_si256(_mm256_andnot_si256(none, _mm256_set1_epi32(0xff00)),
+				_mm256_andnot_si256(_mm256_or_si256(none, one), _mm256_set1_epi32(0xff0000))));
+
+		return _mm256_or_si256(_mm256_and_si256(x, keep), _mm256_andnot_si256(keep, _mm256_set1_epi32(static_cast<int>(0xffffff00))));
+	}
+
+	static __m256i DecodeVector(__m256i x)
+	{
+		// Bytes of 0x80 and above are negative as signed bytes.
+		__m256i padding = _mm256_cmpgt_epi8(_mm256_setzero_si256(), x);
+		__m256i keep = _mm256_or_si256(_mm256_andnot_si256(padding, _mm256_set1_epi32(0x00ffff00)), _mm256_set1_epi32(0xff));
+		return _mm256_and_si256(x, keep);
+	}
+
+#elif defined(MIDI_CODEC_SSE2)
+
+	static __m128i EncodeVector(__m128i x)
+	{
+		__m128i status = _mm_and_si128(x, _mm_set1_epi32(0xff));
+		__m128i high = _mm_and_si128(x, _mm_set1_epi32(0xf0));
+		__m128i f1 = _mm_cmpeq_epi32(status, _mm_set1_epi32(0xf1));
+		__m128i f2 = _mm_cmpeq_epi32(status, _mm_set1_epi32(0xf2));
+		__m128i f3 = _mm_cmpeq_epi32(status, _mm_set1_epi32(0xf3));
+
+		__m128i one = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi32(high, _mm_set1_epi32(0xc0)), _mm_cmpeq_epi32(high, _mm_set1_epi32(0xd0))),
+			_mm_or_si128(f1, f3));
+		__m128i none = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(f1, f2), f3), _mm_cmpeq_epi32(high, _mm_set1_epi32(0xf0)));
+
+		__m128i keep = _mm_or_si128(_mm_set1_epi32(0xff),
+			_mm_or_si128(_mm_andnot_si128(none, _mm_set1_epi32(0xff00)),
+				_mm_andnot_si128(_mm_or_si128(none, one), _mm_set1_epi32(0xff0000))));
+
+		return _mm_or_si128(_mm_and_si128(x, keep), _mm_andnot_si128(keep, _mm_set1_epi32(static_cast<int>(0xffffff00))));
+	}
+
+	static __m128i DecodeVector(__m128i x)
+	{
+		// Bytes of 0x80 and above are negative as signed bytes.
+		__m128i padding = _mm_cmplt_epi8(x, _mm_setzero_si128());
+		__m128i keep = _mm_or_si128(_mm_andnot_si128(padding, _mm_set1_epi32(0x00ffff00)), _mm_set1_epi32(0xff));
+		return _mm_and_si128(x, keep);
+	}
+
+#endif
+};
@@ -7,35 +7,23 @@ struct MidiMessage
 {
     uint8_t bytes[4];
 
-    // Construct from a MIDI-in dword.
-    MidiMessage(uint32_t raw32)
+    // Construct an uninitialized message.
+    MidiMessage()
     {
-        uint8_t status = raw32 & 0xff;
-        uint8_t eventType = status >> 4;
+    }
 
-        bytes[0] = status;
+    // Construct from a MIDI-in dword. The unused data bytes are padded with 0xff.
+    MidiMessage(uint32_t raw32)
+    {
+        // Mask of the bytes to keep: the status and its data bytes.
+        static const uint32_t keepMasks[3] = { 0x000000ff, 0x0000ffff, 0x00ffffff };
+        uint32_t keep = keepMasks[GetDataLength(raw32 & 0xff)];
+        uint32_t value = (raw32 & keep) | ~keep;
 
-        if (eventType == 0xc || eventType == 0xd || status == 0xf1 || status == 0xf3)
-        {
-            // Program change (0xc*), aftertouch (0xd*), timecode (0xf1) or song select (0xf3).
-            bytes[1] = (raw32 >> 8) & 0xff;
-            bytes[2] = 0xff;
-            bytes[3] = 0xff;
-        }
-        else if (eventType != 0xf || status == 0xf2)
-        {
-            // Song position (0xf2) or other kinds of channel voice messages.
-            bytes[1] = (raw32 >> 8) & 0xff;
-            bytes[2] = (raw32 >> 16) & 0xff;
-            bytes[3] = 0xff;
-        }
-        else
-        {
-            // Other system messages: without data bytes.
-            bytes[1] = 0xff;
-            bytes[2] = 0xff;
-            bytes[3] = 0xff;
-        }
+        bytes[0] = static_cast<uint8_t>(value);
+        bytes[1] = static_cast<uint8_t>(value >> 8);
+        bytes[2] = static_cast<uint8_t>(value >> 16);
+        bytes[3] = static_cast<uint8_t>(value >> 24);
     }
 
     // Construct from a byte array.
@@ -47,12 +35,60 @@ struct MidiMessage
         bytes[3] = source[3];
     }
 
-    // Returns a MIDI-out dword.
+    // Returns a MIDI-out dword. Data bytes of 0x80 and above (the padding) are dropped.
     uint32_t GetRaw32() const
     {
+        // (byte >> 7) - 1 is all ones for a data byte and zero otherwise.
         uint32_t temp = bytes[0];
-        if (bytes[1] < 0x80) temp += bytes[1] << 8;
-        if (bytes[2] < 0x80) temp += bytes[2] << 16;
+        temp |= (static_cast<uint32_t>(bytes[1]) << 8) & ((bytes[1] >> 7) - 1U);
+        temp |= (static_cast<uint32_t>(bytes[2]) << 16) & ((bytes[2] >> 7) - 1U);
         return temp;
     }
+
+    // Number of the data bytes following a status byte.
+    // Program change (0xc*), aftertouch (0xd*), timecode (0xf1) and song
+    // select (0xf3) take one; the other system messages but song position
+    // (0xf2) take none; everything else takes two.
+    static int GetDataLength(uint8_t status)
+    {
+        // The table is expanded at compile time from the rule (no constexpr in VS2013).
+#define MIDI_DATA_LENGTH(s) \
+        ((((s) & 0xf0) == 0xc0 || ((s) & 0xf0) == 0xd0 || (s) == 0xf1 || (s) == 0xf3) ? 1 : \
+         (((s) & 0xf0) != 0xf0 || (s) == 0xf2) ? 2 : 0)
+#define MIDI_DATA_LENGTH_ROW(h) \
+        MIDI_DATA_LENGTH(h + 0x0), MIDI_DATA_LENGTH(h + 0x1), MIDI_DATA_LENGTH(h + 0x2), MIDI_DATA_LENGTH(h + 0x3), \
+        MIDI_DATA_LENGTH(h + 0x4), MIDI_DATA_LENGTH(h + 0x5), MIDI_DATA_LENGTH(h + 0x6), MIDI_DATA_LENGTH(h + 0x7), \
+        MIDI_DATA_LENGTH(h + 0x8), MIDI_DATA_LENGTH(h + 0x9), MIDI_DATA_LENGTH(h + 0xa), MIDI_DATA_LENGTH(h + 0xb), \
+        MIDI_DATA_LENGTH(h + 0xc), MIDI_DATA_LENGTH(h + 0xd), MIDI_DATA_LENGTH(h + 0xe), MIDI_DATA_LENGTH(h + 0xf)
+
+        static const uint8_t dataLengths[256] =
+        {
+            MIDI_DATA_LENGTH_ROW(0x00), MIDI_DATA_LENGTH_ROW(0x10), MIDI_DATA_LENGTH_ROW(0x20), MIDI_DATA_LENGTH_ROW(0x30),
+            MIDI_DATA_LENGTH_ROW(0x40), MIDI_DATA_LENGTH_ROW(0x50), MIDI_DATA_LENGTH_ROW(0x60), MIDI_DATA_LENGTH_ROW(0x70),
+            MIDI_DATA_LENGTH_ROW(0x80), MIDI_DATA_LENGTH_ROW(0x90), MIDI_DATA_LENGTH_ROW(0xa0), MIDI_DATA_LENGTH_ROW(0xb0),
+            MIDI_DATA_LENGTH_ROW(0xc0), MIDI_DATA_LENGTH_ROW(0xd0), MIDI_DATA_LENGTH_ROW(0xe0), MIDI_DATA_LENGTH_ROW(0xf0)
+        };
+
+#undef MIDI_DATA_LENGTH_ROW
+#undef MIDI_DATA_LENGTH
+
+        return dataLengths[status];
+    }
+};
+
+struct SysExBuffer;
+
+// MIDI message with its source device and arrival time.
+struct MidiEvent
+{
+    MidiMessage message;
+
+    // SysEx data (message is 0xf0 then), or nullptr for short messages.
+    SysExBuffer* sysex;
+
+    // Index of the source input device.
+    uint8_t device;
+
+    // Arrival time in microseconds (Platform::GetTimestamp).
+    uint64_t timestamp;
 };
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MidiMessage.h"
+
+// Current MIDI state of the input devices, for bringing new clients up to date.
+//
+// Kept per device and channel: controller values, held notes (a bitmap and
+// the velocities), program, pitch bend and channel pressure. It's updated
+// and read by a single thread (the sender).
+class MidiStateCache
+{
+public:
+
+	// Update the state with an incoming message.
+	void Update(const MidiEvent& event)
+	{
+		if (event.sysex != nullptr) return;
+
+		const uint8_t* bytes = event.message.bytes;
+		uint8_t status = bytes[0];
+
+		// System reset clears everything.
+		if (status == 0xff)
+		{
+			devices.clear();
+			return;
+		}
+
+		if (status >= 0xf0) return;
+
+		ChannelState& state = GetDevice(event.device).channels[status & 0x0f];
+
+		switch (status & 0xf0)
+		{
+		case 0x90:
+			if (bytes[2] > 0)
+			{
+				state.SetNote(bytes[1], bytes[2]);
+				break;
+			}
+			// Velocity zero: note off.
+			// Falls through.
+		case 0x80:
+			state.ClearNote(bytes[1]);
+			break;
+		case 0xb0:
+			UpdateController(state, bytes[1], bytes[2]);
+			break;
+		case 0xc0:
+			state.program = bytes[1];
+			break;
+		case 0xd0:
+			state.pressure = bytes[1];
+			break;
+		case 0xe0:
+			state.bend = static_cast<uint16_t>(bytes[1] | (bytes[2] << 7));
+			break;
+		}
+	}
+
+	// Build the messages which reproduce the current state.
+	// Bank select comes before the program change, and the notes last.
+	void GetSnapshot(uint64_t timestamp, std::vector<MidiEvent>& events) const
+	{
+		events.clear();
+		for (size_t device = 0; device < devices.size(); device++)
+		{
+			if (!devices[device]) continue;
+
+			for (int channel = 0; channel < 16; channel++)
+			{
+				const ChannelState& state = devices[device]->channels[channel];
+				auto add = [&](uint8_t status, uint8_t data1, uint8_t data2)
+				{
+					MidiEvent event;
+					event.message = MidiMessage(static_cast<uint32_t>((status | channel) | (data1 << 8) | (data2 << 16)));
+					event.sysex = nullptr;
+					event.device = static_cast<uint8_t>(device);
+					event.timestamp = timestamp;
+					events.push_back(event);
+				};
+
+				if (state.controllers[0] != unknown) add(0xb0, 0, state.controllers[0]);
+				if (state.controllers[32] != unknown) add(0xb0, 32, state.controllers[32]);
+				if (state.program != unknown) add(0xc0, state.program, 0);
+
+				for (int number = 1; number < 120; number++)
+				{
+					if (number != 32 && state.controllers[number] != unknown) add(0xb0, number, state.controllers[number]);
+				}
+
+				if (state.bend != unknownBend) add(0xe0, state.bend & 0x7f, state.bend >> 7);
+				if (state.pressure != unknown) add(0xd0, state.pressure, 0);
+
+				for (int word = 0; word < 2; word++)
+				{
+					for (uint64_t bits = state.notes[word]; bits != 0; bits &= bits - 1)
+					{
+						int note = word * 64 + CountTrailingZeros(bits);
+						add(0x90, note, state.velocities[note]);
+					}
+				}
+			}
+		}
+	}
+
+private:
+
+	static const uint8_t unknown = 0xff;
+	static const uint16_t unknownBend = 0xffff;
+
+	struct ChannelState
+	{
+		uint8_t controllers[128];
+		uint8_t velocities[128];
+		uint64_t notes[2];
+		uint16_t bend;
+		uint8_t program;
+		uint8_t pressure;
+
+		ChannelState()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			memset(controllers, unknown, sizeof(controllers));
+			ClearNotes();
+			bend = unknownBend;
+			program = unknown;
+			pressure = unknown;
+		}
+
+		void SetNote(uint8_t note, uint8_t velocity)
+		{
+			note &= 0x7f;
+			notes[note >> 6] |= 1ULL << (note & 63);
+			velocities[note] = velocity;
+		}
+
+		void ClearNote(uint8_t note)
+		{
+			note &= 0x7f;
+			notes[note >> 6] &= ~(1ULL << (note & 63));
+		}
+
+		void ClearNotes()
+		{
+			notes[0] = notes[1] = 0;
+		}
+	};
+
+	struct DeviceState
+	{
+		ChannelState channels[16];
+	};
+
+	// Indexed by the device ID (0xff for unknown devices).
+	std::vector<std::unique_ptr<DeviceState>> devices;
+
+	DeviceState& GetDevice(uint8_t device)
+	{
+		if (devices.size() <= device) devices.resize(device + 1);
+		if (!devices[device]) devices[device].reset(new DeviceState());
+		return *devices[device];
+	}
+
+	static void UpdateController(ChannelState& state, uint8_t number, uint8_t value)
+	{
+		if (number < 120)
+		{
+			state.controllers[number] = value;
+			return;
+		}
+
+		// Channel mode messages.
+		if (number == 121)
+		{
+			// Reset all controllers.
+			memset(state.controllers, unknown, sizeof(state.controllers));
+			state.bend = unknownBend;
+			state.pressure = unknown;
+		}
+		else if (number == 120 || number >= 123)
+		{
+			// All sound/notes off (and the mode changes which imply it).
+			state.ClearNotes();
+		}
+	}
+
+	static int CountTrailingZeros(uint64_t bits)
+	{
+		int count = 0;
+		while ((bits & 1) == 0)
+		{
+			bits >>= 1;
+			count++;
+		}
+		return count;
+	}
+};
@@ -0,0 +1,202 @@
+#pragma once
+
+#include "stdafx.h"
+#include "ByteRing.h"
+#include "MidiBackend.h"
+#include "MessageQueue.h"
+#include "Metrics.h"
+#include "Platform.h"
+
+// Opened output device with its own send queue and worker thread.
+//
+// The senders only queue the messages, so a slow driver delays its own
+// device and nothing else. The messages of a device keep their order.
+// The device is closed when the port is destroyed, after the queue drains.
+class OutputPort
+{
+public:
+
+	// Size of the send queue.
+	static const size_t queueSize = 4096;
+
+	// Size of the buffer holding the bytes of the queued SysEx messages.
+	static const size_t sysExRingSize = 65536;
+
+	// Counters of the port.
+	struct Stats
+	{
+		unsigned int id;
+		uint64_t depth;          // Messages waiting in the queue.
+		uint64_t sent;
+		uint64_t dropped;        // Rejected because the queue was full, or by the driver.
+		uint64_t sendTimeTotal;  // Time spent in the driver calls (microseconds).
+		uint64_t sendTimeMax;
+	};
+
+	OutputPort(MidiBackend& backend, MidiBackend::Handle handle, unsigned int id)
+		: backend(backend), handle(handle), id(id), queue(queueSize), sysExRing(sysExRingSize)
+	{
+		queued = 0;
+		sysExDropped = 0;
+		rejected = 0;
+		sysExData.reserve(4096);
+		sent = 0;
+		sendTimeTotal = 0;
+		sendTimeMax = 0;
+		stopWorkerThread = false;
+		workerThread = std::thread(&OutputPort::RunWorker, this);
+	}
+
+	~OutputPort()
+	{
+		stopWorkerThread = true;
+		queue.Notify();
+		workerThread.join();
+		backend.CloseOutput(handle);
+	}
+
+	unsigned int GetId() const
+	{
+		return id;
+	}
+
+	// Queue a short message (any thread). Returns false if the queue is full.
+	bool Send(uint32_t raw32)
+	{
+		Item item = { raw32, 0, Platform::GetTimestamp() };
+		return Push(item);
+	}
+
+	// Queue a SysEx message. The data is copied into the port's ring, in
+	// the order of the queue; it's dropped if the ring is full.
+	bool SendLong(const uint8_t* data, size_t length)
+	{
+		Item item = { 0, static_cast<uint32_t>(length), Platform::GetTimestamp() };
+
+		std::lock_guard<std::mutex> guard(sysExMutex);
+		if (length == 0 || !sysExRing.Write(data, length))
+		{
+			sysExDropped.fetch_add(1, std::memory_order_relaxed);
+			Metrics::Get().outputDrops.Add();
+			return false;
+		}
+		if (Push(item)) return true;
+
+		// Take the bytes back: nothing was written after them under the lock.
+		sysExRing.Unwrite(length);
+		return false;
+	}
+
+	Stats GetStats() const
+	{
+		Stats stats;
+		stats.id = id;
+		stats.sent = sent.load(std::memory_order_relaxed);
+		uint64_t rejectedCount = rejected.load(std::memory_order_relaxed);
+		uint64_t doneCount = stats.sent + rejectedCount;
+		uint64_t queuedCount = queued.load(std::memory_order_relaxed);
+		stats.depth = queuedCount > doneCount ? queuedCount - doneCount : 0;
+		stats.dropped = queue.GetOverflowCount() + sysExDropped.load(std::memory_order_relaxed) + rejectedCount;
+		stats.sendTimeTotal = sendTimeTotal.load(std::memory_order_relaxed);
+		stats.sendTimeMax = sendTimeMax.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+private:
+
+	// Queued message. A SysEx message has its bytes in the ring.
+	struct Item
+	{
+		uint32_t raw32;
+		uint32_t sysExLength;
+		uint64_t queuedAt;
+	};
+
+	MidiBackend& backend;
+	MidiBackend::Handle handle;
+	unsigned int id;
+
+	MessageQueue<Item> queue;
+
+	// Bytes of the queued SysEx messages. Written together with the queue
+	// push, so that they are in the order of the items.
+	ByteRing sysExRing;
+	std::mutex sysExMutex;
+
+	// SysEx message being sent (worker thread).
+	std::vector<uint8_t> sysExData;
+	std::thread workerThread;
+	std::atomic<bool> stopWorkerThread;
+
+	// Statistics. Only the queued and SysEx drop counts are written by the senders.
+	std::atomic<uint64_t> queued;
+	std::atomic<uint64_t> sysExDropped;
+	std::atomic<uint64_t> sent;
+	std::atomic<uint64_t> rejected;   // Dequeued but refused by the driver.
+	std::atomic<uint64_t> sendTimeTotal;
+	std::atomic<uint64_t> sendTimeMax;
+
+	bool Push(const Item& item)
+	{
+		if (!queue.TryPush(item))
+		{
+			Metrics::Get().outputDrops.Add();
+			return false;
+		}
+		queued.fetch_add(1, std::memory_order_relaxed);
+		Metrics::Get().outputMessages.Add();
+		return true;
+	}
+
+	// Worker thread. The queue is drained before it exits.
+	void RunWorker()
+	{
+		while (true)
+		{
+			bool stopping = stopWorkerThread;
+
+			Item item;
+			while (queue.TryPop(item)) SendItem(item);
+
+			if (stopping) break;
+			queue.Wait(std::chrono::milliseconds(100));
+		}
+	}
+
+	void SendItem(Item& item)
+	{
+		uint64_t start = Platform::GetTimestamp();
+		Metrics::Get().outputQueueLatency.Record(start - std::min(start, item.queuedAt));
+
+		bool accepted;
+		if (item.sysExLength > 0)
+		{
+			sysExData.resize(item.sysExLength);
+			{
+				std::lock_guard<std::mutex> guard(sysExMutex);
+				sysExRing.Peek(sysExData.data(), sysExData.size());
+				sysExRing.Consume(sysExData.size());
+			}
+			accepted = backend.SendLong(handle, sysExData.data(), sysExData.size());
+		}
+		else
+		{
+			accepted = backend.SendShort(handle, item.raw32);
+		}
+
+		uint64_t elapsed = Platform::GetTimestamp() - start;
+		Metrics::Get().outputSendTime.Record(elapsed);
+		sendTimeTotal.store(sendTimeTotal.load(std::memory_order_relaxed) + elapsed, std::memory_order_relaxed);
+		if (elapsed > sendTimeMax.load(std::memory_order_relaxed)) sendTimeMax.store(elapsed, std::memory_order_relaxed);
+
+		if (accepted)
+		{
+			sent.fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+		{
+			rejected.fetch_add(1, std::memory_order_relaxed);
+			Metrics::Get().outputDrops.Add();
+		}
+	}
+};
@@ -0,0 +1,202 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MidiMessage.h"
+#include "Platform.h"
+#include "Metrics.h"
+
+// Holds the client messages stamped with a future time and emits them at
+// that time from a dedicated thread.
+//
+// The pending messages are kept in a heap ordered by time (and by arrival
+// for the same time). The thread sleeps until shortly before the next one
+// is due and spins for the rest, since the system timers are much coarser
+// than the MIDI timing.
+class OutputScheduler
+{
+public:
+
+	// Receiver of the messages when they are due (scheduler thread).
+	class MessageDelegate
+	{
+	public:
+		virtual void ProcessScheduledMessage(int client, const MidiMessage& message) = 0;
+	};
+
+	// Max number of the pending messages.
+	static const size_t maxPending = 65536;
+
+	// The thread spins for this long before the due time (microseconds).
+	static const uint64_t spinWindow = 500;
+
+	OutputScheduler(MessageDelegate& md)
+		: messageDelegate(md), sequence(0), droppedCount(0), lateCount(0), stopSchedulerThread(true)
+	{
+		running = false;
+	}
+
+	~OutputScheduler()
+	{
+		Stop();
+	}
+
+	void Start()
+	{
+		if (running) return;
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			stopSchedulerThread = false;
+		}
+		schedulerThread = std::thread(&OutputScheduler::RunScheduler, this);
+		running = true;
+	}
+
+	// Stop the thread. The pending messages are emitted at once so that no
+	// note is left hanging.
+	void Stop()
+	{
+		if (!running) return;
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			stopSchedulerThread = true;
+		}
+		condition.notify_one();
+		schedulerThread.join();
+		running = false;
+	}
+
+	// Schedule a message at a time on the Platform::GetTimestamp() clock (any thread).
+	// A past time means as soon as possible, after the earlier messages.
+	// Returns false (the message is dropped) if too many messages are
+	// pending or the thread is not running.
+	bool Schedule(uint64_t time, int client, const MidiMessage& message)
+	{
+		bool earliest;
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			if (stopSchedulerThread || pending.size() >= maxPending)
+			{
+				droppedCount++;
+				return false;
+			}
+
+			Entry entry = { time, sequence++, client, message };
+			pending.push_back(entry);
+			std::push_heap(pending.begin(), pending.end(), Later());
+			earliest = pending.front().sequence == entry.sequence;
+		}
+
+		// Only a new earliest message changes the wake-up time.
+		if (earliest) condition.notify_one();
+		return true;
+	}
+
+	size_t GetPendingCount()
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		return pending.size();
+	}
+
+	// Messages rejected because the scheduler was full or stopped.
+	uint64_t GetDroppedCount()
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		return droppedCount;
+	}
+
+	// Messages emitted more than a millisecond after their time.
+	uint64_t GetLateCount()
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		return lateCount;
+	}
+
+private:
+
+	struct Entry
+	{
+		uint64_t time;
+		uint64_t sequence;
+		int client;
+		MidiMessage message;
+	};
+
+	// Heap order: the earliest entry on top.
+	struct Later
+	{
+		bool operator () (const Entry& a, const Entry& b) const
+		{
+			return a.time != b.time ? a.time > b.time : a.sequence > b.sequence;
+		}
+	};
+
+	MessageDelegate& messageDelegate;
+
+	std::vector<Entry> pending;
+	std::mutex mutex;
+	std::condition_variable condition;
+	uint64_t sequence;
+	uint64_t droppedCount;
+	uint64_t lateCount;
+
+	std::thread schedulerThread;
+	bool stopSchedulerThread;
+	std::atomic<bool> running;
+
+	// Scheduler thread.
+	void RunScheduler()
+	{
+		std::vector<Entry> due;
+		std::unique_lock<std::mutex> lock(mutex);
+
+		while (!stopSchedulerThread)
+		{
+			if (pending.empty())
+			{
+				condition.wait(lock);
+				continue;
+			}
+
+			uint64_t time = pending.front().time;
+			uint64_t now = Platform::GetTimestamp();
+
+			if (time > now + spinWindow)
+			{
+				// Sleep until the spin window; a new earliest message wakes it up.
+				condition.wait_for(lock, std::chrono::microseconds(time - now - spinWindow));
+				continue;
+			}
+
+			if (time > now)
+			{
+				// Spin without the lock so that the clients can keep scheduling.
+				lock.unlock();
+				while (Platform::GetTimestamp() < time) std::this_thread::yield();
+				lock.lock();
+				continue;
+			}
+
+			// Take the all due messages and emit them without the lock.
+			while (!pending.empty() && pending.front().time <= now)
+			{
+				uint64_t lateness = now - pending.front().time;
+				Metrics::Get().schedulerLateness.Record(lateness);
+				if (lateness > 1000) lateCount++;
+				std::pop_heap(pending.begin(), pending.end(), Later());
+				due.push_back(pending.back());
+				pending.pop_back();
+			}
+
+			lock.unlock();
+			for (auto& entry : due) messageDelegate.ProcessScheduledMessage(entry.client, entry.message);
+			due.clear();
+			lock.lock();
+		}
+
+		// Flush in time order.
+		std::sort(pending.begin(), pending.end(), [](const Entry& a, const Entry& b) { return Later()(b, a); });
+		due.swap(pending);
+		lock.unlock();
+		for (auto& entry : due) messageDelegate.ProcessScheduledMessage(entry.client, entry.message);
+	}
+};
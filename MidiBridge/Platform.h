@@ -8,6 +8,69 @@ class Platform
 {
 public:
 
+    // Requests from the system to a running daemon.
+    enum class ControlEvent
+    {
+        None,
+        Stop,    // SIGTERM, SIGINT; console close/Ctrl+C on Windows.
+        Reload,  // SIGHUP: reload the configuration files.
+        Rescan,  // SIGUSR1: rescan the MIDI devices.
+        Stats    // SIGUSR2: dump the metrics report.
+    };
+
+    // Readable end of the wake channel: a loop waits on it with its sockets
+    // and wakes up as soon as an event is posted.
+#ifdef WIN32
+    typedef SOCKET WakeHandle;
+#else
+    typedef int WakeHandle;
+#endif
+
+    // Take the pending event with the highest priority (Stop first).
+    static ControlEvent TakeControlEvent()
+    {
+        volatile sig_atomic_t* pending = GetPendingEvents();
+        for (int i = static_cast<int>(ControlEvent::Stop); i <= static_cast<int>(ControlEvent::Stats); i++)
+        {
+            if (pending[i])
+            {
+                pending[i] = 0;
+                return static_cast<ControlEvent>(i);
+            }
+        }
+        return ControlEvent::None;
+    }
+
+    // Post an event (async signal safe; also the failure handler of the daemon).
+    static void PostControlEvent(ControlEvent event)
+    {
+        GetPendingEvents()[static_cast<int>(event)] = 1;
+        Wake();
+    }
+
+    // The wake channel is created by InstallControlHandlers.
+    static WakeHandle GetControlWakeHandle()
+    {
+        return GetWakeHandles()[0];
+    }
+
+    // Consume the wake ups. Called before taking the events, so that an
+    // event posted in between still wakes the next wait.
+    static void ClearControlWake()
+    {
+        char buffer[64];
+#ifdef WIN32
+        while (recv(GetWakeHandles()[0], buffer, sizeof(buffer), 0) > 0) {}
+#else
+        while (read(GetWakeHandles()[0], buffer, sizeof(buffer)) > 0) {}
+#endif
+    }
+
+    static void RequestStop()
+    {
+        PostControlEvent(ControlEvent::Stop);
+    }
+
 #ifdef WIN32
 
     static void Initialize()
@@ -22,15 +85,169 @@ public:
         WSACleanup();
     }
 
+    // Turn the console events into control events. There are no signals
+    // for the other events; the control endpoint covers them.
+    // The wake channel is a pair of loopback UDP sockets, which WSAPoll can
+    // wait on. Returns false if it can't be created.
+    static bool InstallControlHandlers()
+    {
+        WakeHandle* wake = GetWakeHandles();
+        if (wake[0] == INVALID_SOCKET)
+        {
+            wake[0] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            wake[1] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+            struct sockaddr_in addr;
+            int length = sizeof(addr);
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+            u_long mode = 1;
+            if (wake[0] == INVALID_SOCKET || wake[1] == INVALID_SOCKET ||
+                bind(wake[0], (sockaddr *)&addr, sizeof(addr)) != 0 ||
+                getsockname(wake[0], (sockaddr *)&addr, &length) != 0 ||
+                connect(wake[1], (sockaddr *)&addr, sizeof(addr)) != 0 ||
+                ioctlsocket(wake[0], FIONBIO, &mode) != 0 || ioctlsocket(wake[1], FIONBIO, &mode) != 0)
+            {
+                if (wake[0] != INVALID_SOCKET) closesocket(wake[0]);
+                if (wake[1] != INVALID_SOCKET) closesocket(wake[1]);
+                wake[0] = wake[1] = INVALID_SOCKET;
+                return false;
+            }
+        }
+
+        SetConsoleCtrlHandler(ConsoleHandler, TRUE);
+        return true;
+    }
+
+    // Let a console close wait for the shutdown to finish.
+    static void NotifyStopped()
+    {
+        GetPendingEvents()[stoppedFlag] = 1;
+    }
+
 #else
 
     static void Initialize()
     {
+        // Writing to a lost connection shouldn't kill the process.
+        signal(SIGPIPE, SIG_IGN);
     }
 
     static void Finalize()
     {
     }
 
+    // Turn the signals into control events. The wake channel is a pipe,
+    // written by the handlers. Returns false if it can't be created.
+    static bool InstallControlHandlers()
+    {
+        WakeHandle* wake = GetWakeHandles();
+        if (wake[0] < 0)
+        {
+            if (pipe(wake) != 0)
+            {
+                wake[0] = wake[1] = -1;
+                return false;
+            }
+            for (int i = 0; i < 2; i++) fcntl(wake[i], F_SETFL, fcntl(wake[i], F_GETFL, 0) | O_NONBLOCK);
+        }
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = SignalHandler;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+
+        sigaction(SIGTERM, &action, nullptr);
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGHUP, &action, nullptr);
+        sigaction(SIGUSR1, &action, nullptr);
+        sigaction(SIGUSR2, &action, nullptr);
+        return true;
+    }
+
+    static void NotifyStopped()
+    {
+    }
+
+#endif
+
+    // High resolution monotonic timestamp in microseconds.
+    static uint64_t GetTimestamp()
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now).count());
+    }
+
+private:
+
+    // One flag per control event, plus the stopped flag. Zero-initialized
+    // statically, so the signal handlers can touch them at any time.
+    static const int stoppedFlag = static_cast<int>(ControlEvent::Stats) + 1;
+
+    static volatile sig_atomic_t* GetPendingEvents()
+    {
+        static volatile sig_atomic_t pending[stoppedFlag + 1];
+        return pending;
+    }
+
+#ifdef WIN32
+    static const WakeHandle invalidWakeHandle = INVALID_SOCKET;
+#else
+    static const WakeHandle invalidWakeHandle = -1;
+#endif
+
+    // Read and write ends of the wake channel. Initialized statically too.
+    static WakeHandle* GetWakeHandles()
+    {
+        static WakeHandle handles[2] = { invalidWakeHandle, invalidWakeHandle };
+        return handles;
+    }
+
+    // Signal the wake channel (async signal safe). A full channel is
+    // already signalled.
+    static void Wake()
+    {
+        WakeHandle handle = GetWakeHandles()[1];
+        if (handle == invalidWakeHandle) return;
+        char byte = 0;
+#ifdef WIN32
+        send(handle, &byte, 1, 0);
+#else
+        int savedErrno = errno;
+        if (write(handle, &byte, 1) < 0) {}
+        errno = savedErrno;
+#endif
+    }
+
+#ifdef WIN32
+
+    static BOOL WINAPI ConsoleHandler(DWORD type)
+    {
+        RequestStop();
+
+        // The process is terminated when the handler returns from these.
+        if (type == CTRL_CLOSE_EVENT || type == CTRL_LOGOFF_EVENT || type == CTRL_SHUTDOWN_EVENT)
+        {
+            for (int i = 0; i < 450 && !GetPendingEvents()[stoppedFlag]; i++) Sleep(10);
+        }
+        return TRUE;
+    }
+
+#else
+
+    static void SignalHandler(int signal)
+    {
+        switch (signal)
+        {
+        case SIGHUP: PostControlEvent(ControlEvent::Reload); break;
+        case SIGUSR1: PostControlEvent(ControlEvent::Rescan); break;
+        case SIGUSR2: PostControlEvent(ControlEvent::Stats); break;
+        default: RequestStop(); break;
+        }
+    }
+
 #endif
 };
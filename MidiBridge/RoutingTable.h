@@ -0,0 +1,246 @@
+#pragma once
+
+#include "stdafx.h"
+
+// Routing matrix compiled into flat lookup tables.
+//
+// Input device -> client slots, and (client slot, channel) -> output devices,
+// each as a 64-bit mask. Devices and clients from 63 up share the last bit.
+// The default routes everything everywhere (broadcast). A table is never
+// modified once published; a new one replaces it as a whole.
+//
+// Text form, one rule per line, later rules overriding earlier ones:
+//   in <device|*> clients <slot ...|all|none>
+//   out <slot|*> <channel 1-16|sysex|system|*> outputs <device ...|all|none>
+// "system" covers the system common and real-time messages (0xf1-0xff):
+// time code, song position, clock, transport, active sensing...
+// Everything after '#' is a comment.
+class RoutingTable
+{
+public:
+
+	static const int maxInputs = 256;
+	static const int maxClients = 64;
+
+	// Channel indices used for the SysEx and the other system messages.
+	static const int sysExChannel = 16;
+	static const int systemChannel = 17;
+	static const int channelCount = 18;
+
+	static const uint64_t all = ~0ULL;
+
+	RoutingTable()
+	{
+		for (auto& mask : inputToClients) mask = all;
+		for (auto& client : clientToOutputs)
+		{
+			for (auto& mask : client) mask = all;
+		}
+	}
+
+	static uint64_t GetBit(unsigned int index)
+	{
+		return 1ULL << std::min(index, 63U);
+	}
+
+	// Client slots receiving the messages from an input device.
+	uint64_t GetClients(uint8_t inputDevice) const
+	{
+		return inputToClients[inputDevice];
+	}
+
+	// Output devices receiving a message from a client. Out of range clients
+	// (e.g. a replay) are routed as slot 63.
+	uint64_t GetOutputs(int client, uint8_t status) const
+	{
+		int channel = status < 0xf0 ? (status & 0x0f) : (status == 0xf0 ? sysExChannel : systemChannel);
+		return clientToOutputs[std::min(static_cast<unsigned int>(client), 63U)][channel];
+	}
+
+	// Check if every input goes to every client.
+	bool IsInputBroadcast() const
+	{
+		for (auto mask : inputToClients)
+		{
+			if (mask != all) return false;
+		}
+		return true;
+	}
+
+	// Parse the text form. Returns false with a message on an error.
+	bool Parse(const std::string& text, std::string& error)
+	{
+		size_t start = 0;
+		for (int lineNumber = 1; start < text.size(); lineNumber++)
+		{
+			size_t end = text.find('\n', start);
+			if (end == std::string::npos) end = text.size();
+			std::string line = text.substr(start, end - start);
+			start = end + 1;
+
+			line = line.substr(0, line.find('#'));
+			if (!ParseLine(Tokenize(line), error))
+			{
+				error = "line " + std::to_string(lineNumber) + ": " + error;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Load a routing file.
+	bool Load(const _TCHAR* path, std::string& error)
+	{
+		FILE* file = _tfopen(path, _T("rb"));
+		if (file == nullptr)
+		{
+			error = "can't open the file";
+			return false;
+		}
+
+		std::string text;
+		char buffer[4096];
+		size_t length;
+		while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) text.append(buffer, length);
+		fclose(file);
+
+		return Parse(text, error);
+	}
+
+private:
+
+	uint64_t inputToClients[maxInputs];
+	uint64_t clientToOutputs[maxClients][channelCount];
+
+	static std::vector<std::string> Tokenize(const std::string& line)
+	{
+		std::vector<std::string> tokens;
+		std::string token;
+		for (char c : line)
+		{
+			if (c == ' ' || c == '\t' || c == '\r' || c == ',')
+			{
+				if (!token.empty()) tokens.push_back(token);
+				token.clear();
+			}
+			else
+			{
+				token += c;
+			}
+		}
+		if (!token.empty()) tokens.push_back(token);
+		return tokens;
+	}
+
+	// Parse a number in [0, limit). Returns -1 if it's invalid.
+	static int ParseIndex(const std::string& token, int limit)
+	{
+		if (token.empty() || token.size() > 3) return -1;
+		int value = 0;
+		for (char c : token)
+		{
+			if (c < '0' || c > '9') return -1;
+			value = value * 10 + (c - '0');
+		}
+		return value < limit ? value : -1;
+	}
+
+	// Parse the mask after the keyword: indices, "all" or "none".
+	static bool ParseMask(const std::vector<std::string>& tokens, size_t first, uint64_t& mask, std::string& error)
+	{
+		mask = 0;
+		if (first >= tokens.size())
+		{
+			error = "missing targets";
+			return false;
+		}
+
+		for (size_t i = first; i < tokens.size(); i++)
+		{
+			if (tokens[i] == "all")
+			{
+				mask = all;
+			}
+			else if (tokens[i] != "none")
+			{
+				int index = ParseIndex(tokens[i], 256);
+				if (index < 0)
+				{
+					error = "invalid target '" + tokens[i] + "'";
+					return false;
+				}
+				mask |= GetBit(index);
+			}
+		}
+		return true;
+	}
+
+	bool ParseLine(const std::vector<std::string>& tokens, std::string& error)
+	{
+		if (tokens.empty()) return true;
+
+		if (tokens[0] == "in" && tokens.size() >= 3 && tokens[2] == "clients")
+		{
+			uint64_t mask;
+			if (!ParseMask(tokens, 3, mask, error)) return false;
+
+			int device = tokens[1] == "*" ? -1 : ParseIndex(tokens[1], maxInputs);
+			if (device < 0 && tokens[1] != "*")
+			{
+				error = "invalid input device '" + tokens[1] + "'";
+				return false;
+			}
+
+			for (int i = 0; i < maxInputs; i++)
+			{
+				if (device < 0 || device == i) inputToClients[i] = mask;
+			}
+			return true;
+		}
+
+		if (tokens[0] == "out" && tokens.size() >= 4 && tokens[3] == "outputs")
+		{
+			uint64_t mask;
+			if (!ParseMask(tokens, 4, mask, error)) return false;
+
+			int client = tokens[1] == "*" ? -1 : ParseIndex(tokens[1], maxClients);
+			if (client < 0 && tokens[1] != "*")
+			{
+				error = "invalid client slot '" + tokens[1] + "'";
+				return false;
+			}
+
+			int channel = -1;
+			if (tokens[2] == "sysex")
+			{
+				channel = sysExChannel;
+			}
+			else if (tokens[2] == "system")
+			{
+				channel = systemChannel;
+			}
+			else if (tokens[2] != "*")
+			{
+				channel = ParseIndex(tokens[2], 17) - 1;
+				if (channel < 0)
+				{
+					error = "invalid channel '" + tokens[2] + "'";
+					return false;
+				}
+			}
+
+			for (int i = 0; i < maxClients; i++)
+			{
+				if (client >= 0 && client != i) continue;
+				for (int j = 0; j < channelCount; j++)
+				{
+					if (channel < 0 || channel == j) clientToOutputs[i][j] = mask;
+				}
+			}
+			return true;
+		}
+
+		error = "unknown rule";
+		return false;
+	}
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MidiMessage.h"
+#include "MessageQueue.h"
+#include "Platform.h"
+
+// Session file layout shared by the capture and the replay.
+//
+// Header: "MBSC" and a LE32 version (1).
+// Record: timestamp (LE64, microseconds), kind, device, payload length (LE16),
+//         the four message bytes, then the payload (SysEx data) if any.
+// The device of a client record is the client slot.
+struct SessionFormat
+{
+	static const uint32_t version = 1;
+	static const size_t headerSize = 8;
+	static const size_t recordSize = 16;
+
+	enum class Kind : uint8_t
+	{
+		DeviceInput,    // MIDI in -> bridge
+		DeviceSysEx,
+		ClientMessage,  // Client -> bridge
+		ClientSysEx
+	};
+
+	static bool IsSysEx(Kind kind)
+	{
+		return kind == Kind::DeviceSysEx || kind == Kind::ClientSysEx;
+	}
+};
+
+// Records the traffic through the bridge into an append-only session file.
+// The records are queued and written by a background thread.
+class SessionCapture
+{
+public:
+
+	// Size of the record queue.
+	static const size_t queueSize = 16384;
+
+	SessionCapture()
+		: queue(queueSize), file(nullptr)
+	{
+		active = false;
+		stopWriterThread = false;
+	}
+
+	~SessionCapture()
+	{
+		Stop();
+	}
+
+	// Open the file and start the writer thread.
+	bool Start(const _TCHAR* path)
+	{
+		Stop();
+
+		file = _tfopen(path, _T("wb"));
+		if (file == nullptr) return false;
+
+		uint8_t header[SessionFormat::headerSize] = { 'M', 'B', 'S', 'C', SessionFormat::version, 0, 0, 0 };
+		fwrite(header, 1, sizeof(header), file);
+
+		stopWriterThread = false;
+		writerThread = std::thread(&SessionCapture::RunWriterLoop, this);
+		active = true;
+		return true;
+	}
+
+	// Flush the pending records and close the file.
+	void Stop()
+	{
+		if (!active) return;
+		active = false;
+		stopWriterThread = true;
+		writerThread.join();
+		fclose(file);
+		file = nullptr;
+	}
+
+	bool IsActive() const
+	{
+		return active.load(std::memory_order_relaxed);
+	}
+
+	// Record a message (any thread).
+	void Record(SessionFormat::Kind kind, uint8_t device, const MidiMessage& message, uint64_t timestamp)
+	{
+		if (!IsActive()) return;
+
+		Entry entry;
+		entry.timestamp = timestamp;
+		entry.kind = kind;
+		entry.device = device;
+		entry.message = message;
+		entry.sysex = nullptr;
+		queue.TryPush(entry);
+	}
+
+	// Record a SysEx message. The data is copied.
+	void RecordSysEx(SessionFormat::Kind kind, uint8_t device, const uint8_t* data, size_t length, uint64_t timestamp)
+	{
+		if (!IsActive()) return;
+
+		Entry entry;
+		entry.timestamp = timestamp;
+		entry.kind = kind;
+		entry.device = device;
+		entry.message = MidiMessage(0xf0);
+		entry.sysex = new std::vector<uint8_t>(data, data + std::min<size_t>(length, 0xffff));
+		if (!queue.TryPush(entry)) delete entry.sysex;
+	}
+
+	// Number of the records discarded because the queue was full.
+	uint64_t GetDroppedCount() const
+	{
+		return queue.GetOverflowCount();
+	}
+
+private:
+
+	// Queued record. Only the SysEx records own a heap block.
+	struct Entry
+	{
+		uint64_t timestamp;
+		SessionFormat::Kind kind;
+		uint8_t device;
+		MidiMessage message;
+		std::vector<uint8_t>* sysex;
+	};
+
+	MessageQueue<Entry> queue;
+	std::atomic<bool> active;
+
+	std::thread writerThread;
+	std::atomic<bool> stopWriterThread;
+	FILE* file;
+
+	// Writer thread loop. Polls so that the recording threads never wake it up.
+	void RunWriterLoop()
+	{
+		while (true)
+		{
+			bool stopping = stopWriterThread;
+
+			Entry entry;
+			while (queue.TryPop(entry)) WriteEntry(entry);
+			fflush(file);
+
+			if (stopping) break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	void WriteEntry(Entry& entry)
+	{
+		uint16_t length = entry.sysex != nullptr ? static_cast<uint16_t>(entry.sysex->size()) : 0;
+
+		uint8_t data[SessionFormat::recordSize];
+		for (int i = 0; i < 8; i++) data[i] = static_cast<uint8_t>(entry.timestamp >> (i * 8));
+		data[8] = static_cast<uint8_t>(entry.kind);
+		data[9] = entry.device;
+		data[10] = static_cast<uint8_t>(length);
+		data[11] = static_cast<uint8_t>(length >> 8);
+		memcpy(data + 12, entry.message.bytes, 4);
+		fwrite(data, 1, sizeof(data), file);
+
+		if (entry.sysex != nullptr)
+		{
+			fwrite(entry.sysex->data(), 1, length, file);
+			delete entry.sysex;
+		}
+	}
+};
@@ -0,0 +1,238 @@
+#pragma once
+
+#include "stdafx.h"
+#include "Logger.h"
+#include "SessionCapture.h"
+#include "VirtualMidiBackend.h"
+#include "IpcServer.h"
+
+// Feeds a captured session back through the bridge.
+//
+// The file is memory-mapped and read in place. The device records are
+// injected into the virtual backend and the client records go to the IPC
+// delegate, so the replayed traffic takes the same path as the live one.
+class SessionReplay
+{
+public:
+
+	SessionReplay()
+		: data(nullptr), size(0)
+	{
+#ifdef WIN32
+		fileHandle = INVALID_HANDLE_VALUE;
+		mapping = nullptr;
+#endif
+		stopReplayThread = false;
+	}
+
+	~SessionReplay()
+	{
+		Stop();
+		Close();
+	}
+
+	// Map a session file. Returns false if it's not a valid session.
+	bool Open(const _TCHAR* path)
+	{
+		Close();
+
+#ifdef WIN32
+		fileHandle = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (fileHandle == INVALID_HANDLE_VALUE) return false;
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart < static_cast<LONGLONG>(SessionFormat::headerSize))
+		{
+			Close();
+			return false;
+		}
+		size = static_cast<size_t>(fileSize.QuadPart);
+
+		mapping = CreateFileMapping(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping != nullptr) data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) return false;
+
+		struct stat status;
+		if (fstat(fd, &status) != 0 || status.st_size < static_cast<off_t>(SessionFormat::headerSize))
+		{
+			close(fd);
+			return false;
+		}
+		size = static_cast<size_t>(status.st_size);
+
+		void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (address != MAP_FAILED)
+		{
+			data = static_cast<const uint8_t*>(address);
+			madvise(address, size, MADV_SEQUENTIAL);
+		}
+#endif
+
+		if (data == nullptr || memcmp(data, "MBSC", 4) != 0 || data[4] != SessionFormat::version)
+		{
+			Close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void Close()
+	{
+#ifdef WIN32
+		if (data != nullptr) UnmapViewOfFile(data);
+		if (mapping != nullptr) CloseHandle(mapping);
+		if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+		mapping = nullptr;
+		fileHandle = INVALID_HANDLE_VALUE;
+#else
+		if (data != nullptr) munmap(const_cast<uint8_t*>(data), size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	// Number of the input devices referred by the session.
+	unsigned int GetInputCount() const
+	{
+		unsigned int count = 1;
+		ForEachRecord([&](const Record& record)
+		{
+			if (record.kind == SessionFormat::Kind::DeviceInput || record.kind == SessionFormat::Kind::DeviceSysEx)
+			{
+				if (record.device != 0xff) count = std::max(count, record.device + 1U);
+			}
+			return true;
+		});
+		return count;
+	}
+
+	// Start replaying on a background thread.
+	// In real time the original intervals are kept; otherwise it runs as fast as possible.
+	void Start(VirtualMidiBackend& backend, IpcServer::MessageDelegate& delegate, bool realTime, bool loop)
+	{
+		Stop();
+		stopReplayThread = false;
+		replayThread = std::thread(&SessionReplay::RunReplay, this, &backend, &delegate, realTime, loop);
+	}
+
+	void Stop()
+	{
+		stopReplayThread = true;
+		if (replayThread.joinable()) replayThread.join();
+	}
+
+private:
+
+	// Record parsed from the mapping.
+	struct Record
+	{
+		uint64_t timestamp;
+		SessionFormat::Kind kind;
+		uint8_t device;
+		const uint8_t* bytes;
+		const uint8_t* payload;
+		uint16_t length;
+	};
+
+	const uint8_t* data;
+	size_t size;
+
+#ifdef WIN32
+	HANDLE fileHandle;
+	HANDLE mapping;
+#endif
+
+	std::thread replayThread;
+	std::atomic<bool> stopReplayThread;
+
+	// Iterate over the records until the function returns false.
+	// A truncated record at the end (an interrupted capture) is ignored.
+	template <typename Function>
+	void ForEachRecord(Function function) const
+	{
+		size_t offset = SessionFormat::headerSize;
+		while (offset + SessionFormat::recordSize <= size)
+		{
+			const uint8_t* p = data + offset;
+
+			Record record;
+			record.timestamp = 0;
+			for (int i = 7; i >= 0; i--) record.timestamp = (record.timestamp << 8) | p[i];
+			record.kind = static_cast<SessionFormat::Kind>(p[8]);
+			record.device = p[9];
+			record.length = static_cast<uint16_t>(p[10] | (p[11] << 8));
+			record.bytes = p + 12;
+			record.payload = p + SessionFormat::recordSize;
+
+			offset += SessionFormat::recordSize + record.length;
+			if (offset > size) break;
+
+			if (!function(record)) break;
+		}
+	}
+
+	// Replay thread.
+	void RunReplay(VirtualMidiBackend* backend, IpcServer::MessageDelegate* delegate, bool realTime, bool loop)
+	{
+		// The inputs have to be opened by the bridge first.
+		unsigned int inputCount = GetInputCount();
+		while (!stopReplayThread)
+		{
+			bool started = true;
+			for (auto i = 0U; i < inputCount; i++) started = started && backend->IsInputStarted(i);
+			if (started) break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		do
+		{
+			uint64_t count = 0;
+			uint64_t firstTimestamp = 0;
+			auto start = std::chrono::steady_clock::now();
+
+			ForEachRecord([&](const Record& record)
+			{
+				if (stopReplayThread) return false;
+
+				if (realTime)
+				{
+					if (count == 0) firstTimestamp = record.timestamp;
+					auto offset = std::chrono::microseconds(record.timestamp - std::min(record.timestamp, firstTimestamp));
+					std::this_thread::sleep_until(start + offset);
+				}
+
+				Dispatch(*backend, *delegate, record);
+				count++;
+				return true;
+			});
+
+			Logger::RecordMisc("Replayed %llu records.", static_cast<unsigned long long>(count));
+		}
+		while (loop && !stopReplayThread);
+	}
+
+	static void Dispatch(VirtualMidiBackend& backend, IpcServer::MessageDelegate& delegate, const Record& record)
+	{
+		unsigned int device = record.device == 0xff ? 0 : record.device;
+
+		switch (record.kind)
+		{
+		case SessionFormat::Kind::DeviceInput:
+			backend.Inject(device, MidiMessage(record.bytes).GetRaw32());
+			break;
+		case SessionFormat::Kind::DeviceSysEx:
+			backend.InjectSysEx(device, record.payload, record.length);
+			break;
+		case SessionFormat::Kind::ClientMessage:
+			delegate.ProcessIncomingIpcMessagesFromClient(record.device, record.bytes, 1);
+			break;
+		case SessionFormat::Kind::ClientSysEx:
+			delegate.ProcessIncomingSysExFromClient(record.device, record.payload, record.length);
+			break;
+		}
+	}
+};
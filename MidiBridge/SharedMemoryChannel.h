@@ -0,0 +1,301 @@
+#pragma once
+
+#include "stdafx.h"
+
+// Shared memory transport for a client on the same host.
+//
+// The mapping holds two single-producer/single-consumer byte rings, one for
+// each direction, carrying the same stream as the TCP connection. A sleeping
+// consumer is woken through a futex on Linux or a named event on Windows.
+class SharedMemoryChannel
+{
+public:
+
+	// Ring capacity in bytes (power of two).
+	static const uint32_t ringCapacity = 64 * 1024;
+
+	// Layout identification.
+	static const uint32_t layoutMagic = 0x4d424d53; // "SMBM"
+	static const uint32_t layoutVersion = 1;
+
+	SharedMemoryChannel()
+		: layout(nullptr), owner(false), sendRing(nullptr), receiveRing(nullptr), sendData(nullptr), receiveData(nullptr)
+	{
+#ifdef WIN32
+		mapping = nullptr;
+		sendEvent = nullptr;
+		receiveEvent = nullptr;
+#endif
+	}
+
+	~SharedMemoryChannel()
+	{
+		Destroy();
+	}
+
+	// Name of the shared memory object for a channel ID.
+	// The events on Windows are named with "-s2c" and "-c2s" appended.
+	static std::string GetName(int port, int id)
+	{
+#ifdef WIN32
+		return "Local\\midibridge-" + std::to_string(port) + "-" + std::to_string(id);
+#else
+		return "/midibridge-" + std::to_string(port) + "-" + std::to_string(id);
+#endif
+	}
+
+	// Create the shared memory object (server side).
+	bool Create(const std::string& objectName)
+	{
+		name = objectName;
+
+#ifdef WIN32
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(Layout), name.c_str());
+		if (mapping == nullptr) return false;
+
+		layout = static_cast<Layout*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Layout)));
+		sendEvent = CreateEventA(nullptr, FALSE, FALSE, (name + "-s2c").c_str());
+		receiveEvent = CreateEventA(nullptr, FALSE, FALSE, (name + "-c2s").c_str());
+
+		if (layout == nullptr || sendEvent == nullptr || receiveEvent == nullptr)
+		{
+			Destroy();
+			return false;
+		}
+#else
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0 && errno == EEXIST)
+		{
+			// Left by a bridge which didn't exit cleanly. The name is derived from
+			// the port this server holds, so no live bridge can be using it.
+			shm_unlink(name.c_str());
+			fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		}
+		if (fd < 0) return false;
+
+		if (ftruncate(fd, sizeof(Layout)) != 0)
+		{
+			close(fd);
+			shm_unlink(name.c_str());
+			return false;
+		}
+
+		void* address = mmap(nullptr, sizeof(Layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+
+		if (address == MAP_FAILED)
+		{
+			shm_unlink(name.c_str());
+			return false;
+		}
+
+		layout = static_cast<Layout*>(address);
+#endif
+
+		owner = true;
+		SetDirection(true);
+
+		InitializeRing(layout->toClient);
+		InitializeRing(layout->toServer);
+		layout->version = layoutVersion;
+		layout->capacity = ringCapacity;
+		std::atomic_thread_fence(std::memory_order_release);
+		layout->magic = layoutMagic;
+
+		return true;
+	}
+
+	// Open an existing shared memory object (client side).
+	bool Open(const std::string& objectName)
+	{
+		name = objectName;
+
+#ifdef WIN32
+		mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+		if (mapping == nullptr) return false;
+
+		layout = static_cast<Layout*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Layout)));
+		sendEvent = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, (name + "-c2s").c_str());
+		receiveEvent = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, (name + "-s2c").c_str());
+
+		if (layout == nullptr || sendEvent == nullptr || receiveEvent == nullptr)
+		{
+			Destroy();
+			return false;
+		}
+#else
+		int fd = shm_open(name.c_str(), O_RDWR, 0600);
+		if (fd < 0) return false;
+
+		void* address = mmap(nullptr, sizeof(Layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (address == MAP_FAILED) return false;
+
+		layout = static_cast<Layout*>(address);
+#endif
+
+		owner = false;
+		SetDirection(false);
+
+		if (layout->magic != layoutMagic || layout->version != layoutVersion || layout->capacity != ringCapacity)
+		{
+			Destroy();
+			return false;
+		}
+
+		return true;
+	}
+
+	// Release the shared memory object. Only the creator removes the name.
+	void Destroy()
+	{
+#ifdef WIN32
+		if (layout != nullptr) UnmapViewOfFile(layout);
+		if (mapping != nullptr) CloseHandle(mapping);
+		if (sendEvent != nullptr) CloseHandle(sendEvent);
+		if (receiveEvent != nullptr) CloseHandle(receiveEvent);
+		mapping = sendEvent = receiveEvent = nullptr;
+#else
+		if (layout != nullptr)
+		{
+			munmap(layout, sizeof(Layout));
+			if (owner) shm_unlink(name.c_str());
+		}
+#endif
+		layout = nullptr;
+	}
+
+	// Write data for the peer (single producer). All or nothing.
+	bool Write(const uint8_t* data, size_t length)
+	{
+		Ring& ring = *sendRing;
+		uint32_t head = ring.head.load(std::memory_order_acquire);
+		uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+		if (length > ringCapacity - (tail - head)) return false;
+
+		uint8_t* buffer = sendData;
+		uint32_t offset = tail & (ringCapacity - 1);
+		size_t first = std::min(length, static_cast<size_t>(ringCapacity - offset));
+		memcpy(buffer + offset, data, first);
+		memcpy(buffer, data + first, length - first);
+
+		ring.tail.store(tail + static_cast<uint32_t>(length), std::memory_order_release);
+		WakePeer();
+		return true;
+	}
+
+	// Read data from the peer (single consumer). Returns the number of bytes read.
+	size_t Read(uint8_t* data, size_t length)
+	{
+		Ring& ring = *receiveRing;
+		uint32_t head = ring.head.load(std::memory_order_relaxed);
+		uint32_t tail = ring.tail.load(std::memory_order_acquire);
+		length = std::min(length, static_cast<size_t>(tail - head));
+
+		const uint8_t* buffer = receiveData;
+		uint32_t offset = head & (ringCapacity - 1);
+		size_t first = std::min(length, static_cast<size_t>(ringCapacity - offset));
+		memcpy(data, buffer + offset, first);
+		memcpy(data + first, buffer, length - first);
+
+		ring.head.store(head + static_cast<uint32_t>(length), std::memory_order_release);
+		return length;
+	}
+
+	// Sleep until the peer writes something or the timeout expires.
+	void WaitForData(int timeoutMilliseconds)
+	{
+		Ring& ring = *receiveRing;
+		uint32_t signal = ring.signal.load(std::memory_order_relaxed);
+
+		ring.waiting.store(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (ring.tail.load(std::memory_order_relaxed) == ring.head.load(std::memory_order_relaxed))
+		{
+#ifdef WIN32
+			(void)signal;
+			WaitForSingleObject(receiveEvent, timeoutMilliseconds);
+#else
+			timespec timeout;
+			timeout.tv_sec = timeoutMilliseconds / 1000;
+			timeout.tv_nsec = (timeoutMilliseconds % 1000) * 1000000L;
+			syscall(SYS_futex, reinterpret_cast<uint32_t*>(&ring.signal), FUTEX_WAIT, signal, &timeout, nullptr, 0);
+#endif
+		}
+
+		ring.waiting.store(0, std::memory_order_relaxed);
+	}
+
+private:
+
+	// Ring control block. Positions are free-running counters.
+	struct Ring
+	{
+		alignas(64) std::atomic<uint32_t> head;
+		alignas(64) std::atomic<uint32_t> tail;
+		alignas(64) std::atomic<uint32_t> signal;
+		std::atomic<uint32_t> waiting;
+	};
+
+	// Memory layout of the shared object.
+	struct Layout
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t capacity;
+		Ring toClient;
+		Ring toServer;
+		alignas(64) uint8_t toClientData[ringCapacity];
+		alignas(64) uint8_t toServerData[ringCapacity];
+	};
+
+	static_assert((ringCapacity & (ringCapacity - 1)) == 0, "Ring capacity must be a power of two.");
+
+	Layout* layout;
+	std::string name;
+	bool owner;
+
+	// Rings seen from this side: the server sends on toClient, the client on toServer.
+	Ring* sendRing;
+	Ring* receiveRing;
+	uint8_t* sendData;
+	uint8_t* receiveData;
+
+#ifdef WIN32
+	HANDLE mapping;
+	HANDLE sendEvent;
+	HANDLE receiveEvent;
+#endif
+
+	void SetDirection(bool server)
+	{
+		sendRing = server ? &layout->toClient : &layout->toServer;
+		receiveRing = server ? &layout->toServer : &layout->toClient;
+		sendData = server ? layout->toClientData : layout->toServerData;
+		receiveData = server ? layout->toServerData : layout->toClientData;
+	}
+
+	static void InitializeRing(Ring& ring)
+	{
+		ring.head.store(0, std::memory_order_relaxed);
+		ring.tail.store(0, std::memory_order_relaxed);
+		ring.signal.store(0, std::memory_order_relaxed);
+		ring.waiting.store(0, std::memory_order_relaxed);
+	}
+
+	// Wake up the peer if it's waiting for data.
+	void WakePeer()
+	{
+		Ring& ring = *sendRing;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (ring.waiting.load(std::memory_order_relaxed) == 0) return;
+
+		ring.signal.fetch_add(1, std::memory_order_release);
+#ifdef WIN32
+		SetEvent(sendEvent);
+#else
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&ring.signal), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#endif
+	}
+};
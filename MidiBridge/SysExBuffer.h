@@ -0,0 +1,86 @@
+#pragma once
+
+#include "stdafx.h"
+
+// Buffer holding a system exclusive message.
+// The consumer hands it back to its owner with Release() after dispatching it.
+struct SysExBuffer
+{
+	// Owner which recycles the buffer.
+	class Owner
+	{
+	public:
+		virtual void RecycleSysExBuffer(SysExBuffer* buffer) = 0;
+	};
+
+	uint8_t* data;
+	uint32_t capacity;
+	uint32_t length;
+
+	Owner* owner;
+
+	// Owner specific data (e.g. the driver header).
+	void* context;
+
+	void Release()
+	{
+		owner->RecycleSysExBuffer(this);
+	}
+};
+
+// Preallocated pool of SysEx buffers.
+class SysExPool : public SysExBuffer::Owner
+{
+public:
+
+	// Max size of a SysEx message handled by the bridge.
+	static const uint32_t defaultBlockSize = 4096;
+
+	SysExPool(size_t blockCount = 64, uint32_t blockSize = defaultBlockSize)
+		: storage(blockCount * blockSize), buffers(blockCount)
+	{
+		freeList.reserve(blockCount);
+		for (size_t i = 0; i < blockCount; i++)
+		{
+			SysExBuffer& buffer = buffers[i];
+			buffer.data = &storage[i * blockSize];
+			buffer.capacity = blockSize;
+			buffer.length = 0;
+			buffer.owner = this;
+			buffer.context = nullptr;
+			freeList.push_back(&buffer);
+		}
+	}
+
+	// Take a buffer from the pool. Returns nullptr if exhausted.
+	SysExBuffer* Acquire()
+	{
+		std::lock_guard<std::mutex> guard(freeListMutex);
+		if (freeList.empty()) return nullptr;
+		SysExBuffer* buffer = freeList.back();
+		freeList.pop_back();
+		buffer->length = 0;
+		buffer->owner = this;
+		return buffer;
+	}
+
+	// Return a buffer to the pool.
+	void RecycleSysExBuffer(SysExBuffer* buffer) override
+	{
+		std::lock_guard<std::mutex> guard(freeListMutex);
+		freeList.push_back(buffer);
+	}
+
+	size_t GetFreeCount()
+	{
+		std::lock_guard<std::mutex> guard(freeListMutex);
+		return freeList.size();
+	}
+
+private:
+
+	std::vector<uint8_t> storage;
+	std::vector<SysExBuffer> buffers;
+	std::vector<SysExBuffer*> freeList;
+	std::mutex freeListMutex;
+};
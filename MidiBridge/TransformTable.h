@@ -0,0 +1,410 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MidiMessage.h"
+
+// Message transforms compiled into flat lookup tables.
+//
+// Two stages: "in" applies to the device input before the clients get it,
+// "out" to the client messages before the devices get them. A stage maps
+// a message with a fixed sequence of table lookups, whatever the rules:
+//   status -> status (channel remap) and drop flag
+//   (status, data 1) -> data 1 (transpose)
+//   (status, data 1) -> curve, curve[data 2] -> data 2 (velocity, CC scaling)
+// The padding bytes (0xff) map to themselves. A table is never modified
+// once published; a new one replaces it as a whole.
+//
+// Text form, one rule per line, later rules overriding earlier ones. The
+// rules select on the incoming channel and apply together, so a remapped
+// note still gets the transpose and the curve of its original channel.
+//   <in|out> channel <1-16|*> <1-16>
+//   <in|out> transpose <channel|*> <semitones>
+//   <in|out> velocity <channel|*> <min> <max> [exponent]
+//   <in|out> cc <channel|*> <number|*> <min> <max> [<from min> <from max>]
+//   <in|out> drop <channel|*> <type ...>
+// Types: note, polypressure, cc, program, pressure, bend, sysex, timecode,
+// songposition, songselect, tune, clock, transport, activesensing, reset.
+// The channel is ignored for the system types. Everything after '#' is a
+// comment.
+class TransformTable
+{
+public:
+
+	// Max number of the curves (velocity and CC rules) per stage.
+	static const int maxCurves = 256;
+
+	// Transforms of one direction.
+	class Stage
+	{
+	public:
+
+		Stage()
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				statusMap[i] = static_cast<uint8_t>(i);
+				dropMap[i] = 0;
+			}
+			for (auto& row : data1Map)
+			{
+				for (int i = 0; i < 256; i++) row[i] = static_cast<uint8_t>(i);
+			}
+			memset(curveMap, 0, sizeof(curveMap));
+
+			// Curve 0 is the identity.
+			AddCurve();
+		}
+
+		// Transform a short message in place. Returns false if it is dropped.
+		bool Apply(MidiMessage& message) const
+		{
+			uint8_t status = message.bytes[0];
+
+			// Not a status byte (a malformed client message): passed as it is,
+			// since the rows are indexed by the status without its top bit.
+			if (status < 0x80) return true;
+
+			uint8_t data1 = message.bytes[1];
+			int row = status & 0x7f;
+			message.bytes[0] = statusMap[status];
+			message.bytes[1] = data1Map[row][data1];
+			message.bytes[2] = curves[curveMap[row][data1 & 0x7f] * 256 + message.bytes[2]];
+			return dropMap[status] == 0;
+		}
+
+		// Check if the SysEx messages pass.
+		bool PassesSysEx() const
+		{
+			return dropMap[0xf0] == 0;
+		}
+
+	private:
+
+		friend class TransformTable;
+
+		uint8_t statusMap[256];
+		uint8_t dropMap[256];
+
+		// Indexed by the status without the top bit.
+		uint8_t data1Map[128][256];
+		uint8_t curveMap[128][128];
+
+		// 256 entries per curve.
+		std::vector<uint8_t> curves;
+
+		// Append a curve (the identity) and return its index, or -1 if full.
+		int AddCurve()
+		{
+			int index = static_cast<int>(curves.size() / 256);
+			if (index >= maxCurves) return -1;
+			for (int i = 0; i < 256; i++) curves.push_back(static_cast<uint8_t>(i));
+			return index;
+		}
+
+		uint8_t* GetCurve(int index)
+		{
+			return &curves[index * 256];
+		}
+	};
+
+	Stage input;
+	Stage output;
+
+	// Parse the text form. Returns false with a message on an error.
+	bool Parse(const std::string& text, std::string& error)
+	{
+		size_t start = 0;
+		for (int lineNumber = 1; start < text.size(); lineNumber++)
+		{
+			size_t end = text.find('\n', start);
+			if (end == std::string::npos) end = text.size();
+			std::string line = text.substr(start, end - start);
+			start = end + 1;
+
+			line = line.substr(0, line.find('#'));
+			if (!ParseLine(Tokenize(line), error))
+			{
+				error = "line " + std::to_string(lineNumber) + ": " + error;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Load a transform file.
+	bool Load(const _TCHAR* path, std::string& error)
+	{
+		FILE* file = _tfopen(path, _T("rb"));
+		if (file == nullptr)
+		{
+			error = "can't open the file";
+			return false;
+		}
+
+		std::string text;
+		char buffer[4096];
+		size_t length;
+		while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) text.append(buffer, length);
+		fclose(file);
+
+		return Parse(text, error);
+	}
+
+private:
+
+	static std::vector<std::string> Tokenize(const std::string& line)
+	{
+		std::vector<std::string> tokens;
+		std::string token;
+		for (char c : line)
+		{
+			if (c == ' ' || c == '\t' || c == '\r' || c == ',')
+			{
+				if (!token.empty()) tokens.push_back(token);
+				token.clear();
+			}
+			else
+			{
+				token += c;
+			}
+		}
+		if (!token.empty()) tokens.push_back(token);
+		return tokens;
+	}
+
+	// Parse an integer in [low, high]. Returns false if it's invalid.
+	static bool ParseInteger(const std::string& token, int low, int high, int& value)
+	{
+		size_t i = (!token.empty() && (token[0] == '-' || token[0] == '+')) ? 1 : 0;
+		if (i == token.size() || token.size() > i + 3) return false;
+		value = 0;
+		for (; i < token.size(); i++)
+		{
+			if (token[i] < '0' || token[i] > '9') return false;
+			value = value * 10 + (token[i] - '0');
+		}
+		if (token[0] == '-') value = -value;
+		return value >= low && value <= high;
+	}
+
+	// Parse a channel (1-16) or "*" (-1).
+	static bool ParseChannel(const std::string& token, int& channel, std::string& error)
+	{
+		if (token == "*")
+		{
+			channel = -1;
+			return true;
+		}
+		if (!ParseInteger(token, 1, 16, channel))
+		{
+			error = "invalid channel '" + token + "'";
+			return false;
+		}
+		channel--;
+		return true;
+	}
+
+	// Statuses of a message type: channel messages on the channels selected,
+	// system messages as they are. Returns false on an unknown type.
+	static bool GetStatuses(const std::string& type, int channel, std::vector<int>& statuses)
+	{
+		static const struct { const char* name; int first; int last; bool channelMessage; } types[] =
+		{
+			{ "note", 0x80, 0x90, true },
+			{ "polypressure", 0xa0, 0xa0, true },
+			{ "cc", 0xb0, 0xb0, true },
+			{ "program", 0xc0, 0xc0, true },
+			{ "pressure", 0xd0, 0xd0, true },
+			{ "bend", 0xe0, 0xe0, true },
+			{ "sysex", 0xf0, 0xf0, false },
+			{ "timecode", 0xf1, 0xf1, false },
+			{ "songposition", 0xf2, 0xf2, false },
+			{ "songselect", 0xf3, 0xf3, false },
+			{ "tune", 0xf6, 0xf6, false },
+			{ "clock", 0xf8, 0xf8, false },
+			{ "transport", 0xfa, 0xfc, false },
+			{ "activesensing", 0xfe, 0xfe, false },
+			{ "reset", 0xff, 0xff, false },
+		};
+
+		for (auto& entry : types)
+		{
+			if (type != entry.name) continue;
+			if (entry.channelMessage)
+			{
+				for (int status = entry.first; status <= entry.last; status += 0x10)
+				{
+					for (int i = 0; i < 16; i++)
+					{
+						if (Selects(channel, i)) statuses.push_back(status | i);
+					}
+				}
+			}
+			else
+			{
+				for (int status = entry.first; status <= entry.last; status++) statuses.push_back(status);
+			}
+			return true;
+		}
+		return false;
+	}
+
+	// Channels selected by a rule.
+	static bool Selects(int channel, int i)
+	{
+		return channel < 0 || channel == i;
+	}
+
+	bool ParseLine(const std::vector<std::string>& tokens, std::string& error)
+	{
+		if (tokens.empty()) return true;
+
+		if (tokens.size() < 3 || (tokens[0] != "in" && tokens[0] != "out"))
+		{
+			error = "unknown rule";
+			return false;
+		}
+
+		Stage& stage = tokens[0] == "in" ? input : output;
+		const std::string& kind = tokens[1];
+
+		int channel;
+		if (!ParseChannel(tokens[2], channel, error)) return false;
+
+		if (kind == "channel" && tokens.size() == 4)
+		{
+			int target;
+			if (!ParseInteger(tokens[3], 1, 16, target))
+			{
+				error = "invalid channel '" + tokens[3] + "'";
+				return false;
+			}
+
+			for (int status = 0x80; status < 0xf0; status++)
+			{
+				if (Selects(channel, status & 0x0f)) stage.statusMap[status] = static_cast<uint8_t>((status & 0xf0) | (target - 1));
+			}
+			return true;
+		}
+
+		if (kind == "transpose" && tokens.size() == 4)
+		{
+			int semitones;
+			if (!ParseInteger(tokens[3], -127, 127, semitones))
+			{
+				error = "invalid transpose '" + tokens[3] + "'";
+				return false;
+			}
+
+			// Note off, note on and poly pressure; clamped so that a note off
+			// still matches its note on.
+			for (int status = 0x80; status < 0xb0; status++)
+			{
+				if (!Selects(channel, status & 0x0f)) continue;
+				for (int note = 0; note < 128; note++)
+				{
+					stage.data1Map[status & 0x7f][note] = static_cast<uint8_t>(std::min(std::max(note + semitones, 0), 127));
+				}
+			}
+			return true;
+		}
+
+		if (kind == "velocity" && (tokens.size() == 5 || tokens.size() == 6))
+		{
+			int low, high;
+			double exponent = 1.0;
+			if (!ParseInteger(tokens[3], 1, 127, low) || !ParseInteger(tokens[4], 1, 127, high) ||
+				(tokens.size() == 6 && !ParseExponent(tokens[5], exponent)))
+			{
+				error = "invalid velocity curve";
+				return false;
+			}
+
+			int index = stage.AddCurve();
+			if (index < 0)
+			{
+				error = "too many curves";
+				return false;
+			}
+
+			// Velocity 0 (note off) stays 0.
+			uint8_t* curve = stage.GetCurve(index);
+			for (int v = 1; v < 128; v++)
+			{
+				double x = std::pow((v - 1) / 126.0, exponent);
+				curve[v] = static_cast<uint8_t>(std::lround(low + (high - low) * x));
+			}
+
+			for (int i = 0; i < 16; i++)
+			{
+				if (Selects(channel, i)) memset(stage.curveMap[0x10 | i], index, 128);
+			}
+			return true;
+		}
+
+		if (kind == "cc" && (tokens.size() == 6 || tokens.size() == 8))
+		{
+			int number = -1;
+			if (tokens[3] != "*" && !ParseInteger(tokens[3], 0, 127, number))
+			{
+				error = "invalid controller '" + tokens[3] + "'";
+				return false;
+			}
+
+			int low, high, fromLow = 0, fromHigh = 127;
+			if (!ParseInteger(tokens[4], 0, 127, low) || !ParseInteger(tokens[5], 0, 127, high) ||
+				(tokens.size() == 8 && (!ParseInteger(tokens[6], 0, 127, fromLow) || !ParseInteger(tokens[7], 0, 127, fromHigh) || fromLow >= fromHigh)))
+			{
+				error = "invalid controller range";
+				return false;
+			}
+
+			int index = stage.AddCurve();
+			if (index < 0)
+			{
+				error = "too many curves";
+				return false;
+			}
+
+			uint8_t* curve = stage.GetCurve(index);
+			for (int v = 0; v < 128; v++)
+			{
+				int clamped = std::min(std::max(v, fromLow), fromHigh);
+				curve[v] = static_cast<uint8_t>(low + std::lround(static_cast<double>(clamped - fromLow) * (high - low) / (fromHigh - fromLow)));
+			}
+
+			for (int i = 0; i < 16; i++)
+			{
+				if (!Selects(channel, i)) continue;
+				if (number < 0) memset(stage.curveMap[0x30 | i], index, 128);
+				else stage.curveMap[0x30 | i][number] = static_cast<uint8_t>(index);
+			}
+			return true;
+		}
+
+		if (kind == "drop" && tokens.size() >= 4)
+		{
+			for (size_t i = 3; i < tokens.size(); i++)
+			{
+				std::vector<int> statuses;
+				if (!GetStatuses(tokens[i], channel, statuses))
+				{
+					error = "unknown message type '" + tokens[i] + "'";
+					return false;
+				}
+				for (int status : statuses) stage.dropMap[status] = 1;
+			}
+			return true;
+		}
+
+		error = "unknown rule";
+		return false;
+	}
+
+	static bool ParseExponent(const std::string& token, double& value)
+	{
+		char* end;
+		value = strtod(token.c_str(), &end);
+		return *end == '\0' && value > 0.05 && value < 20;
+	}
+};
@@ -0,0 +1,278 @@
+#pragma once
+
+#include "stdafx.h"
+#include "MidiBackend.h"
+
+// In-process MIDI backend with virtual devices.
+// Inputs are fed by Inject() or by a fixed-rate generator; outputs are captured.
+class VirtualMidiBackend : public MidiBackend
+{
+public:
+
+	// Captured output message.
+	struct Capture
+	{
+		unsigned int deviceId;
+		uint32_t raw32;
+		std::chrono::steady_clock::time_point time;
+	};
+
+	VirtualMidiBackend(unsigned int inputCount = 1, unsigned int outputCount = 1, size_t captureLimit = 65536)
+		: captureLimit(captureLimit)
+	{
+		for (auto i = 0U; i < inputCount; i++) inputs.emplace_back(new Port(i));
+		for (auto i = 0U; i < outputCount; i++) outputs.emplace_back(new Port(i));
+		generatorRunning = false;
+		capturesDropped = 0;
+	}
+
+	~VirtualMidiBackend()
+	{
+		StopGenerator();
+	}
+
+	// Device enumeration.
+	unsigned int GetInputCount() override
+	{
+		return static_cast<unsigned int>(inputs.size());
+	}
+
+	unsigned int GetOutputCount() override
+	{
+		return static_cast<unsigned int>(outputs.size());
+	}
+
+	std::string GetInputName(unsigned int id) override
+	{
+		return "Virtual In " + std::to_string(id + 1);
+	}
+
+	std::string GetOutputName(unsigned int id) override
+	{
+		return "Virtual Out " + std::to_string(id + 1);
+	}
+
+	// Input devices.
+	bool OpenInput(unsigned int id, InputHandler& handler, Handle& handle) override
+	{
+		if (id >= inputs.size()) return false;
+		std::lock_guard<std::mutex> guard(portMutex);
+		Port& port = *inputs[id];
+		if (port.opened) return false;
+		port.opened = true;
+		port.started = false;
+		port.handler = &handler;
+		handle = reinterpret_cast<Handle>(&port);
+		return true;
+	}
+
+	bool StartInput(Handle handle) override
+	{
+		std::lock_guard<std::mutex> guard(portMutex);
+		reinterpret_cast<Port*>(handle)->started = true;
+		reinterpret_cast<Port*>(handle)->startTime = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	void CloseInput(Handle handle) override
+	{
+		std::lock_guard<std::mutex> guard(portMutex);
+		Port& port = *reinterpret_cast<Port*>(handle);
+		port.opened = false;
+		port.started = false;
+		if (port.handler != nullptr) port.handler->ProcessBackendInputClosed(handle);
+		port.handler = nullptr;
+	}
+
+	bool GetInputId(Handle handle, unsigned int& id) override
+	{
+		id = reinterpret_cast<Port*>(handle)->id;
+		return true;
+	}
+
+	// Output devices.
+	bool OpenOutput(unsigned int id, Handle& handle) override
+	{
+		if (id >= outputs.size()) return false;
+		std::lock_guard<std::mutex> guard(portMutex);
+		Port& port = *outputs[id];
+		if (port.opened) return false;
+		port.opened = true;
+		handle = reinterpret_cast<Handle>(&port);
+		return true;
+	}
+
+	void CloseOutput(Handle handle) override
+	{
+		std::lock_guard<std::mutex> guard(portMutex);
+		reinterpret_cast<Port*>(handle)->opened = false;
+	}
+
+	bool GetOutputId(Handle handle, unsigned int& id) override
+	{
+		id = reinterpret_cast<Port*>(handle)->id;
+		return true;
+	}
+
+	bool SendShort(Handle handle, uint32_t raw32) override
+	{
+		Port& port = *reinterpret_cast<Port*>(handle);
+		if (!port.opened) return false;
+		Capture capture = { port.id, raw32, std::chrono::steady_clock::now() };
+		std::lock_guard<std::mutex> guard(captureMutex);
+		if (captures.size() < captureLimit)
+		{
+			captures.push_back(capture);
+		}
+		else
+		{
+			capturesDropped++;
+		}
+		return true;
+	}
+
+	bool SendLong(Handle handle, const uint8_t* data, size_t length) override
+	{
+		// Captured as a sequence of the bytes packed in dwords.
+		for (size_t i = 0; i < length; i += 3)
+		{
+			uint32_t raw32 = data[i];
+			if (i + 1 < length) raw32 |= data[i + 1] << 8;
+			if (i + 2 < length) raw32 |= data[i + 2] << 16;
+			if (!SendShort(handle, raw32)) return false;
+		}
+		return true;
+	}
+
+	// Check if an input device has been opened and started by the client.
+	bool IsInputStarted(unsigned int id)
+	{
+		if (id >= inputs.size()) return false;
+		std::lock_guard<std::mutex> guard(portMutex);
+		return inputs[id]->started;
+	}
+
+	// Feed a message to an input device. Returns false if it's not started.
+	bool Inject(unsigned int id, uint32_t raw32)
+	{
+		if (id >= inputs.size()) return false;
+		std::lock_guard<std::mutex> guard(portMutex);
+		Port& port = *inputs[id];
+		if (!port.started) return false;
+		auto elapsed = std::chrono::steady_clock::now() - port.startTime;
+		auto driverTime = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+		port.handler->ProcessBackendInput(reinterpret_cast<Handle>(&port), raw32, static_cast<uint32_t>(driverTime));
+		return true;
+	}
+
+	// Feed a SysEx message to an input device. Returns false if it's not started
+	// or there is no free buffer.
+	bool InjectSysEx(unsigned int id, const uint8_t* data, size_t length)
+	{
+		if (id >= inputs.size()) return false;
+		std::lock_guard<std::mutex> guard(portMutex);
+		Port& port = *inputs[id];
+		if (!port.started) return false;
+
+		SysExBuffer* buffer = sysExPool.Acquire();
+		if (buffer == nullptr) return false;
+		if (length > buffer->capacity)
+		{
+			buffer->Release();
+			return false;
+		}
+
+		memcpy(buffer->data, data, length);
+		buffer->length = static_cast<uint32_t>(length);
+
+		auto elapsed = std::chrono::steady_clock::now() - port.startTime;
+		auto driverTime = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+		port.handler->ProcessBackendLongInput(reinterpret_cast<Handle>(&port), buffer, static_cast<uint32_t>(driverTime));
+		return true;
+	}
+
+	// Start injecting a deterministic message pattern at a fixed rate (messages/sec).
+	void StartGenerator(unsigned int id, double rate)
+	{
+		StopGenerator();
+		generatorRunning = true;
+		generatorThread = std::thread(&VirtualMidiBackend::RunGenerator, this, id, rate);
+	}
+
+	void StopGenerator()
+	{
+		generatorRunning = false;
+		if (generatorThread.joinable()) generatorThread.join();
+	}
+
+	// Take the captured messages out of the backend.
+	std::vector<Capture> TakeCaptures()
+	{
+		std::vector<Capture> taken;
+		std::lock_guard<std::mutex> guard(captureMutex);
+		taken.swap(captures);
+		return taken;
+	}
+
+	// Number of captures discarded because the capture buffer was full.
+	size_t GetDroppedCaptureCount()
+	{
+		std::lock_guard<std::mutex> guard(captureMutex);
+		return capturesDropped;
+	}
+
+	// Message of the generator pattern at the given sequence number.
+	// Cycles through note-on, CC sweep and note-off on channel 1.
+	static uint32_t GetPatternMessage(uint64_t sequence)
+	{
+		uint32_t step = static_cast<uint32_t>(sequence % 3);
+		uint32_t value = static_cast<uint32_t>((sequence / 3) & 0x7f);
+		if (step == 0) return 0x90 | (value << 8) | (0x64 << 16);
+		if (step == 1) return 0xb0 | (0x01 << 8) | (value << 16);
+		return 0x80 | (value << 8);
+	}
+
+private:
+
+	// Virtual device.
+	struct Port
+	{
+		unsigned int id;
+		bool opened;
+		bool started;
+		InputHandler* handler;
+		std::chrono::steady_clock::time_point startTime;
+
+		Port(unsigned int id)
+			: id(id), opened(false), started(false), handler(nullptr)
+		{
+		}
+	};
+
+	std::vector<std::unique_ptr<Port>> inputs;
+	std::vector<std::unique_ptr<Port>> outputs;
+	std::mutex portMutex;
+
+	std::vector<Capture> captures;
+	size_t captureLimit;
+	size_t capturesDropped;
+	std::mutex captureMutex;
+
+	std::thread generatorThread;
+	std::atomic<bool> generatorRunning;
+
+	SysExPool sysExPool;
+
+	// Generator thread loop.
+	void RunGenerator(unsigned int id, double rate)
+	{
+		auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / rate));
+		auto next = std::chrono::steady_clock::now();
+		for (uint64_t sequence = 0; generatorRunning; sequence++)
+		{
+			Inject(id, GetPatternMessage(sequence));
+			next += interval;
+			std::this_thread::sleep_until(next);
+		}
+	}
+};
@@ -0,0 +1,344 @@
+#pragma once
+
+#ifdef WIN32
+
+#include "stdafx.h"
+#include "MidiBackend.h"
+#include "Logger.h"
+#include "SysExBuffer.h"
+
+// MIDI backend using the Windows multimedia API (winmm).
+class WinMmBackend : public MidiBackend, SysExBuffer::Owner
+{
+public:
+
+	// Number of SysEx buffers given to each device.
+	static const int buffersPerDevice = 4;
+
+	// Max time to wait for an output buffer the driver is playing (milliseconds).
+	// A 4 KB message takes about 1.3 s at 31250 baud.
+	static const int sendTimeout = 10000;
+
+	// Max time to wait for the consumer to release the input buffers (milliseconds).
+	static const int closeTimeout = 5000;
+
+	// Device enumeration.
+	unsigned int GetInputCount() override
+	{
+		return midiInGetNumDevs();
+	}
+
+	unsigned int GetOutputCount() override
+	{
+		return midiOutGetNumDevs();
+	}
+
+	std::string GetInputName(unsigned int id) override
+	{
+		// A device unplugged during the enumeration has no name (no failure).
+		MIDIINCAPSW caps;
+		if (midiInGetDevCapsW(id, &caps, sizeof(caps)) != MMSYSERR_NOERROR) return std::string();
+		return ToUtf8(caps.szPname);
+	}
+
+	std::string GetOutputName(unsigned int id) override
+	{
+		MIDIOUTCAPSW caps;
+		if (midiOutGetDevCapsW(id, &caps, sizeof(caps)) != MMSYSERR_NOERROR) return std::string();
+		return ToUtf8(caps.szPname);
+	}
+
+	// Input devices.
+	bool OpenInput(unsigned int id, InputHandler& handler, Handle& handle) override
+	{
+		std::unique_ptr<InputPort> port(new InputPort(handler));
+
+		DWORD_PTR callback = reinterpret_cast<DWORD_PTR>(MidiInProc);
+		DWORD_PTR instance = reinterpret_cast<DWORD_PTR>(port.get());
+		if (midiInOpen(&port->hMidiIn, id, callback, instance, CALLBACK_FUNCTION) != MMSYSERR_NOERROR) return false;
+
+		// Give the driver the buffers for the long messages.
+		for (int i = 0; i < buffersPerDevice; i++)
+		{
+			SysExBuffer* buffer = sysExPool.Acquire();
+			if (buffer == nullptr) break;
+
+			MIDIHDR& header = port->headers[i];
+			memset(&header, 0, sizeof(header));
+			header.lpData = reinterpret_cast<LPSTR>(buffer->data);
+			header.dwBufferLength = buffer->capacity;
+			header.dwUser = reinterpret_cast<DWORD_PTR>(buffer);
+
+			buffer->owner = this;
+			buffer->context = port.get();
+
+			if (midiInPrepareHeader(port->hMidiIn, &header, sizeof(header)) != MMSYSERR_NOERROR ||
+				midiInAddBuffer(port->hMidiIn, &header, sizeof(header)) != MMSYSERR_NOERROR)
+			{
+				sysExPool.RecycleSysExBuffer(buffer);
+				header.dwUser = 0;
+				break;
+			}
+		}
+
+		handle = reinterpret_cast<Handle>(port.release());
+		return true;
+	}
+
+	bool StartInput(Handle handle) override
+	{
+		return midiInStart(GetInputPort(handle).hMidiIn) == MMSYSERR_NOERROR;
+	}
+
+	void CloseInput(Handle handle) override
+	{
+		InputPort* port = &GetInputPort(handle);
+		port->closing = true;
+
+		// Reset returns the buffers held by the driver.
+		midiInStop(port->hMidiIn);
+		midiInReset(port->hMidiIn);
+
+		// Wait for the buffers still being dispatched: the consumer releases
+		// them through RecycleSysExBuffer, which uses the port.
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(closeTimeout);
+		while (port->dispatching > 0 && std::chrono::steady_clock::now() < deadline) Sleep(1);
+		bool released = port->dispatching == 0;
+
+		for (auto& header : port->headers)
+		{
+			if (header.dwUser == 0) continue;
+			midiInUnprepareHeader(port->hMidiIn, &header, sizeof(header));
+			if (released) sysExPool.RecycleSysExBuffer(reinterpret_cast<SysExBuffer*>(header.dwUser));
+		}
+
+		midiInClose(port->hMidiIn);
+
+		// A buffer still held would release through a deleted port: the port
+		// and its buffers are leaked instead. The closing flag keeps the late
+		// release away from the driver.
+		if (released)
+		{
+			delete port;
+		}
+		else
+		{
+			Logger::RecordMisc("Input (%0llx) closed with SysEx buffers still held.", static_cast<unsigned long long>(handle));
+		}
+	}
+
+	bool GetInputId(Handle handle, unsigned int& id) override
+	{
+		UINT idFromHandle;
+		if (midiInGetID(GetInputPort(handle).hMidiIn, &idFromHandle) != MMSYSERR_NOERROR) return false;
+		id = idFromHandle;
+		return true;
+	}
+
+	// Output devices.
+	bool OpenOutput(unsigned int id, Handle& handle) override
+	{
+		std::unique_ptr<OutputPort> port(new OutputPort());
+		if (midiOutOpen(&port->hMidiOut, id, 0, 0, CALLBACK_NULL) != MMSYSERR_NOERROR) return false;
+
+		// Prepare the headers for the long messages once.
+		for (int i = 0; i < buffersPerDevice; i++)
+		{
+			SysExBuffer* buffer = sysExPool.Acquire();
+			if (buffer == nullptr) break;
+
+			MIDIHDR& header = port->headers[i];
+			memset(&header, 0, sizeof(header));
+			header.lpData = reinterpret_cast<LPSTR>(buffer->data);
+			header.dwBufferLength = buffer->capacity;
+			header.dwUser = reinterpret_cast<DWORD_PTR>(buffer);
+
+			if (midiOutPrepareHeader(port->hMidiOut, &header, sizeof(header)) != MMSYSERR_NOERROR)
+			{
+				sysExPool.RecycleSysExBuffer(buffer);
+				header.dwUser = 0;
+				break;
+			}
+
+			// Mark it as available.
+			header.dwFlags |= MHDR_DONE;
+		}
+
+		handle = reinterpret_cast<Handle>(port.release());
+		return true;
+	}
+
+	void CloseOutput(Handle handle) override
+	{
+		OutputPort* port = &GetOutputPort(handle);
+
+		// Reset returns the long messages being played.
+		midiOutReset(port->hMidiOut);
+
+		for (auto& header : port->headers)
+		{
+			if (header.dwUser == 0) continue;
+			header.dwBufferLength = reinterpret_cast<SysExBuffer*>(header.dwUser)->capacity;
+			while (midiOutUnprepareHeader(port->hMidiOut, &header, sizeof(header)) == MIDIERR_STILLPLAYING) Sleep(1);
+			sysExPool.RecycleSysExBuffer(reinterpret_cast<SysExBuffer*>(header.dwUser));
+		}
+
+		midiOutClose(port->hMidiOut);
+		delete port;
+	}
+
+	bool GetOutputId(Handle handle, unsigned int& id) override
+	{
+		UINT idFromHandle;
+		if (midiOutGetID(GetOutputPort(handle).hMidiOut, &idFromHandle) != MMSYSERR_NOERROR) return false;
+		id = idFromHandle;
+		return true;
+	}
+
+	bool SendShort(Handle handle, uint32_t raw32) override
+	{
+		return midiOutShortMsg(GetOutputPort(handle).hMidiOut, raw32) == MMSYSERR_NOERROR;
+	}
+
+	// Called from the device's output worker, so it can wait for the driver
+	// to finish with a buffer. Returns false if the message is not sent.
+	bool SendLong(Handle handle, const uint8_t* data, size_t length) override
+	{
+		OutputPort& port = GetOutputPort(handle);
+		std::lock_guard<std::mutex> guard(port.sendMutex);
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(sendTimeout);
+		while (true)
+		{
+			// Find a header which the driver has finished with.
+			for (auto& header : port.headers)
+			{
+				if (header.dwUser == 0 || (header.dwFlags & MHDR_DONE) == 0) continue;
+				if (length > reinterpret_cast<SysExBuffer*>(header.dwUser)->capacity) return false;
+
+				// The driver plays dwBufferLength bytes: set it to the message.
+				memcpy(header.lpData, data, length);
+				header.dwBufferLength = static_cast<DWORD>(length);
+				header.dwFlags &= ~MHDR_DONE;
+
+				if (midiOutLongMsg(port.hMidiOut, &header, sizeof(header)) == MMSYSERR_NOERROR) return true;
+
+				header.dwFlags |= MHDR_DONE;
+				return false;
+			}
+
+			// All the buffers are in flight.
+			if (std::chrono::steady_clock::now() >= deadline) return false;
+			Sleep(1);
+		}
+	}
+
+private:
+
+	// Opened input device.
+	struct InputPort
+	{
+		HMIDIIN hMidiIn;
+		InputHandler& handler;
+		MIDIHDR headers[buffersPerDevice];
+		std::atomic<int> dispatching;
+		std::atomic<bool> closing;
+
+		InputPort(InputHandler& handler)
+			: hMidiIn(nullptr), handler(handler), dispatching(0), closing(false)
+		{
+			memset(headers, 0, sizeof(headers));
+		}
+	};
+
+	// Opened output device.
+	struct OutputPort
+	{
+		HMIDIOUT hMidiOut;
+		MIDIHDR headers[buffersPerDevice];
+		std::mutex sendMutex;
+
+		OutputPort()
+			: hMidiOut(nullptr)
+		{
+			memset(headers, 0, sizeof(headers));
+		}
+	};
+
+	// Buffers for the long messages.
+	SysExPool sysExPool;
+
+	static InputPort& GetInputPort(Handle handle)
+	{
+		return *reinterpret_cast<InputPort*>(handle);
+	}
+
+	static OutputPort& GetOutputPort(Handle handle)
+	{
+		return *reinterpret_cast<OutputPort*>(handle);
+	}
+
+	// Give a dispatched input buffer back to the driver. It can't be done in
+	// the callback, so it happens on the consumer's thread.
+	void RecycleSysExBuffer(SysExBuffer* buffer) override
+	{
+		InputPort* port = static_cast<InputPort*>(buffer->context);
+		if (!port->closing)
+		{
+			for (auto& header : port->headers)
+			{
+				if (header.dwUser == reinterpret_cast<DWORD_PTR>(buffer))
+				{
+					midiInAddBuffer(port->hMidiIn, &header, sizeof(header));
+					break;
+				}
+			}
+		}
+		port->dispatching--;
+	}
+
+	// Utility: convert a device name to UTF-8.
+	static std::string ToUtf8(const wchar_t* name)
+	{
+		char buffer[MAXPNAMELEN * 4];
+		int length = WideCharToMultiByte(CP_UTF8, 0, name, -1, buffer, sizeof(buffer), nullptr, nullptr);
+		return length > 0 ? std::string(buffer) : std::string();
+	}
+
+	// MIDI callback function.
+	static void CALLBACK MidiInProc(HMIDIIN hMidiIn, UINT wMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+	{
+		auto port = reinterpret_cast<InputPort*>(dwInstance);
+		auto handle = reinterpret_cast<Handle>(port);
+
+		if (wMsg == MIM_DATA)
+		{
+			port->handler.ProcessBackendInput(handle, static_cast<uint32_t>(dwParam1), static_cast<uint32_t>(dwParam2));
+		}
+		else if (wMsg == MIM_LONGDATA)
+		{
+			auto header = reinterpret_cast<MIDIHDR*>(dwParam1);
+			auto buffer = reinterpret_cast<SysExBuffer*>(header->dwUser);
+
+			// Counted before checking the flag, so that CloseInput either
+			// waits for this buffer or this callback sees the flag.
+			port->dispatching++;
+			if (port->closing)
+			{
+				port->dispatching--;
+				return;
+			}
+
+			// An empty buffer (e.g. after an overflow) is dispatched too, so that
+			// the consumer gives it back to the driver; otherwise the input runs out.
+			buffer->length = header->dwBytesRecorded;
+			port->handler.ProcessBackendLongInput(handle, buffer, static_cast<uint32_t>(dwParam2));
+		}
+		else if (wMsg == MIM_CLOSE)
+		{
+			port->handler.ProcessBackendInputClosed(handle);
+		}
+	}
+};
+
+#endif
@@ -1,6 +1,9 @@
 #include "stdafx.h"
 #include "Platform.h"
 #include "BridgeApp.h"
+#include "WinMmBackend.h"
+#include "VirtualMidiBackend.h"
+#include "SessionReplay.h"
 
 int _tmain(int argc, _TCHAR* argv[])
 {
@@ -8,25 +11,151 @@ int _tmain(int argc, _TCHAR* argv[])
 
 	// Parse the options.
 	bool interactive = false;
+	bool daemon = false;
+	bool useVirtualDevices = false;
+	double virtualRate = 0;
+	std::basic_string<_TCHAR> replayPath;
+	bool replayRealTime = true;
+	bool replayLoop = false;
+	BridgeApp::Settings settings;
 	for (int i = 0; i < argc; i++)
 	{
-		auto arg = std::wstring(argv[i]);
-		if (arg == L"/i" || arg == L"-i")
+		auto arg = std::basic_string<_TCHAR>(argv[i]);
+		if (arg == _T("/i") || arg == _T("-i"))
 		{
 			interactive = true;
 		}
+		else if (arg == _T("/daemon") || arg == _T("-daemon"))
+		{
+			daemon = true;
+		}
+		else if ((arg == _T("/controlport") || arg == _T("-controlport")) && i + 1 < argc)
+		{
+			settings.controlPort = std::stoi(argv[++i]);
+		}
+		else if (arg == _T("/v") || arg == _T("-v"))
+		{
+			useVirtualDevices = true;
+		}
+		else if ((arg == _T("/vrate") || arg == _T("-vrate")) && i + 1 < argc)
+		{
+			useVirtualDevices = true;
+			virtualRate = std::stod(argv[++i]);
+		}
+		else if ((arg == _T("/batch") || arg == _T("-batch")) && i + 1 < argc)
+		{
+			settings.maxBatch = std::stoi(argv[++i]);
+		}
+		else if ((arg == _T("/delay") || arg == _T("-delay")) && i + 1 < argc)
+		{
+			settings.maxDelay = std::stoi(argv[++i]);
+		}
+		else if ((arg == _T("/coalesce") || arg == _T("-coalesce")) && i + 1 < argc)
+		{
+			settings.coalesceWindow = std::stoi(argv[++i]);
+		}
+		else if ((arg == _T("/watch") || arg == _T("-watch")) && i + 1 < argc)
+		{
+			settings.deviceWatchInterval = std::stoi(argv[++i]);
+		}
+		else if (arg == _T("/stats") || arg == _T("-stats"))
+		{
+			settings.metricsPort = MetricsEndpoint::defaultPortNumber;
+		}
+		else if ((arg == _T("/statsport") || arg == _T("-statsport")) && i + 1 < argc)
+		{
+			settings.metricsPort = std::stoi(argv[++i]);
+		}
+		else if ((arg == _T("/clock") || arg == _T("-clock")) && i + 1 < argc)
+		{
+			auto mode = std::basic_string<_TCHAR>(argv[++i]);
+			settings.clockMode = (mode == _T("tempo")) ? ClockTracker::Mode::Tempo :
+				(mode == _T("both")) ? ClockTracker::Mode::Both : ClockTracker::Mode::Raw;
+		}
+		else if ((arg == _T("/clients") || arg == _T("-clients")) && i + 1 < argc)
+		{
+			settings.ipc.maxClients = std::stoi(argv[++i]);
+		}
+		else if ((arg == _T("/slow") || arg == _T("-slow")) && i + 1 < argc)
+		{
+			auto policy = std::basic_string<_TCHAR>(argv[++i]);
+			settings.ipc.slowClientPolicy = (policy == _T("disconnect")) ?
+				IpcServer::SlowClientPolicy::Disconnect : IpcServer::SlowClientPolicy::DropMessages;
+		}
+		else if ((arg == _T("/routes") || arg == _T("-routes")) && i + 1 < argc)
+		{
+			settings.routingPath = argv[++i];
+		}
+		else if ((arg == _T("/transform") || arg == _T("-transform")) && i + 1 < argc)
+		{
+			settings.transformPath = argv[++i];
+		}
+		else if ((arg == _T("/capture") || arg == _T("-capture")) && i + 1 < argc)
+		{
+			settings.capturePath = argv[++i];
+		}
+		else if ((arg == _T("/replay") || arg == _T("-replay")) && i + 1 < argc)
+		{
+			useVirtualDevices = true;
+			replayPath = argv[++i];
+		}
+		else if (arg == _T("/replayfast") || arg == _T("-replayfast"))
+		{
+			replayRealTime = false;
+		}
+		else if (arg == _T("/replayloop") || arg == _T("-replayloop"))
+		{
+			replayLoop = true;
+		}
+		else if ((arg == _T("/logfile") || arg == _T("-logfile")) && i + 1 < argc)
+		{
+			Debug::Assert(Logger::OpenFile(argv[++i]), "Failed to open the log file.");
+		}
+	}
+
+	Logger::Start();
+
+	// Map the session to replay.
+	SessionReplay replay;
+	if (!replayPath.empty())
+	{
+		Debug::Assert(replay.Open(replayPath.c_str()), "Failed to open the session file.");
 	}
 
+	// Select the MIDI backend. A replay needs as many virtual inputs as the session has.
+	VirtualMidiBackend virtualBackend(replayPath.empty() ? 1 : replay.GetInputCount());
+#ifdef WIN32
+	WinMmBackend winMmBackend;
+	MidiBackend& backend = useVirtualDevices ? static_cast<MidiBackend&>(virtualBackend) : winMmBackend;
+#else
+	// Only the virtual devices are available here.
+	(void)useVirtualDevices;
+	MidiBackend& backend = virtualBackend;
+#endif
+
 	// Run the app in the specified mode.
-	if (interactive)
+	BridgeApp app(backend, settings);
+	if (virtualRate > 0) virtualBackend.StartGenerator(0, virtualRate);
+	if (!replayPath.empty()) replay.Start(virtualBackend, app, replayRealTime, replayLoop);
+
+	int result = 0;
+	if (daemon)
 	{
-		BridgeApp().RunInteractive();
+		result = app.RunDaemon();
+	}
+	else if (interactive)
+	{
+		app.RunInteractive();
 	}
 	else
 	{
-		BridgeApp().RunAutomatic();
+		app.RunAutomatic();
 	}
 
+	replay.Stop();
+	virtualBackend.StopGenerator();
+	Logger::Stop();
+
     Platform::Finalize();
-    return 0;
+    return result;
 }
@@ -1,17 +1,56 @@
 #pragma once
 
+#ifdef WIN32
+
 #include "targetver.h"
 
 #include <stdio.h>
 #include <tchar.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Substitutes for the TCHAR mappings.
+typedef char _TCHAR;
+#define _tmain main
+#define _T(x) x
+#define _tfopen fopen
+
+#endif
+
 #include <cstdio>
+#include <csignal>
 #include <cstdlib>
 #include <cassert>
 #include <cstdint>
 #include <cstdarg>
+#include <cmath>
 #include <vector>
+#include <unordered_map>
+#include <algorithm>
 #include <string>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <condition_variable>